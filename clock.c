@@ -21,7 +21,7 @@
  * You can verify this for yourself using gcc -v.
  *******************************************************/
 
-#if defined(__i386__)  
+#if defined(__i386__) || defined(__x86_64__)
 /*******************************************************
  * Pentium versions of start_counter() and get_counter()
  *******************************************************/
@@ -71,6 +71,15 @@ double get_counter()
 }
 /* $end x86cyclecounter */
 
+/* Return the current value of the cycle counter. */
+double read_counter()
+{
+    unsigned hi, lo;
+
+    access_counter(&hi, &lo);
+    return (double) hi * (1 << 30) * 4 + lo;
+}
+
 #elif defined(__alpha)
 
 /****************************************************
@@ -133,6 +142,11 @@ double get_counter()
     return result;
 }
 
+double read_counter()
+{
+    return (double) counter();
+}
+
 #else
 
 /****************************************************************
@@ -158,6 +172,13 @@ double get_counter()
     printf("Please choose another timing package in config.h.\n");
     exit(1);
 }
+
+double read_counter() 
+{
+    printf("ERROR: You are trying to use a read_counter routine in clock.c\n");
+    printf("that has not been implemented yet on this platform.\n");
+    exit(1);
+}
 #endif
 
 
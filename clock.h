@@ -6,6 +6,9 @@ void start_counter();
 /* Get # cycles since counter started */
 double get_counter();
 
+/* Get the raw value of the counter, without disturbing start_counter */
+double read_counter();
+
 /* Measure overhead for counter */
 double ovhd();
 
@@ -58,10 +58,17 @@
 #define ALIGNMENT 8  
 
 /* 
- * Maximum heap size in bytes 
+ * Default maximum heap size in bytes. memlib reserves this much address
+ * space and commits it lazily; override it at runtime with -m.
  */
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
 
+/*
+ * Largest heap -m accepts: mm.c keeps block lengths in 32-bit tags, so
+ * the whole heap as one free block must stay under 4 GB
+ */
+#define MAX_HEAP_LIMIT ((size_t)0xffff0000)  /* 4 GB less 64 KB */
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
@@ -15,10 +15,15 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <stdint.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
+#include "nullmm.h"
+#include "runenv.h"
+#include "trace.h"
 #include "config.h"
 
 /**********************
@@ -27,11 +32,10 @@
 
 /* Misc */
 #define MAXLINE     1024 /* max string size */
-#define HDRLINES       4 /* number of header lines in a trace file */
-#define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define LINENUM(i) TRACE_LINENUM(i)
 
-/* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+/* Returns true if p is a-byte aligned */
+#define IS_ALIGNED(p, a)  ((((uintptr_t)(p)) % (a)) == 0)
 
 /****************************** 
  * The key compound data types 
@@ -44,23 +48,41 @@ typedef struct range_t {
     struct range_t *next;  /* next list element */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/*
+ * A trace compiled for the timed replay loops. Each op is one word
+ * holding its type in the top three bits and its byte size in the rest
+ * (for a free, the size of the block it releases), and the block it
+ * refers to is a slot in a dense table that is reused as soon as the
+ * block is freed, so the table stays as small as the peak number of
+ * live blocks. Consecutive ops of the same type are grouped into runs
+ * that the replay loops execute without dispatching on each op.
+ */
+#define PK_TYPE_SHIFT 29
+#define PK_IS_BATCH(type) ((type) == BATCH_ALLOC || (type) == BATCH_FREE)
+#define PK_SIZE_MASK  ((1u << PK_TYPE_SHIFT) - 1)
+#define PK_WORD(type, size) (((unsigned)(type) << PK_TYPE_SHIFT) | (size))
+#define PK_TYPE(w)    ((w) >> PK_TYPE_SHIFT)
+#define PK_SIZE(w)    ((w) & PK_SIZE_MASK)
+
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
+    int type;            /* op type shared by the whole run */
+    int start;           /* index of the first op of the run */
+    int end;             /* index one past the last op of the run */
+} oprun_t;
 
-/* Holds the information for one trace file*/
 typedef struct {
-    int sugg_heapsize;   /* suggested heap size (unused) */
-    int num_ids;         /* number of alloc/realloc ids */
-    int num_ops;         /* number of distinct requests */
-    int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
-    char **blocks;       /* array of ptrs returned by malloc/realloc... */
-    size_t *block_sizes; /* ... and a corresponding array of payload sizes */
-} trace_t;
+    int num_ops;         /* number of ops in the stream */
+    int num_runs;        /* number of same-type runs */
+    int num_slots;       /* peak number of live blocks */
+    unsigned *words;     /* packed op type and size, one per op */
+    unsigned *slots;     /* dense block slot used by each op; for a
+			    batch op, where its slots start in batch_slots */
+    unsigned *args;      /* alignment of a memalign op, count of a batch op */
+    unsigned *batch_slots; /* slots of the ids of each batch op, in turn */
+    void **batch_ptrs;   /* room for the pointers of the largest batch */
+    oprun_t *runs;       /* maximal runs of ops of one type */
+    char **slot_ptrs;    /* block pointers, indexed by slot */
+} packed_t;
 
 /* 
  * Holds the params to the xxx_speed functions, which are timed by fcyc. 
@@ -70,17 +92,90 @@ typedef struct {
 typedef struct {
     trace_t *trace;  
     range_t *ranges;
+    packed_t *packed;    /* compiled op stream replayed by the timed loops */
+    int touch;           /* if set, write and read back every payload */
 } speed_t;
 
+/*
+ * The entry points of an allocator, for the replay loops that are
+ * shared between mm malloc and libc malloc
+ */
+typedef struct {
+    void *(*malloc)(size_t);
+    void *(*calloc)(size_t, size_t);
+    void *(*memalign)(size_t, size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+    size_t (*malloc_batch)(size_t, size_t, void **);
+    void (*free_batch)(void **, size_t);
+} engine_t;
+
+/*
+ * In touch mode (-T) the replay writes one byte in every TOUCH_STRIDE
+ * bytes of each payload it gets, and reads them back before freeing it
+ */
+#define TOUCH_STRIDE 64
+
+/*
+ * Cycles spent in each entry point of the allocator, split by request
+ * size. Bucket b holds requests of at most 16 * 4^b bytes; the last
+ * bucket holds everything larger. The first index is the traceop_t type.
+ */
+#define NOPTYPES 7
+#define NBUCKETS 7
+
+typedef struct {
+    double count[NOPTYPES][NBUCKETS];  /* number of requests */
+    double cycles[NOPTYPES][NBUCKETS]; /* cycles spent serving them */
+} breakdown_t;
+
+/*
+ * The shape of the heap at one point of a trace, as seen by walking it
+ * with mm_heap_walk. Free blocks are counted in the same size buckets
+ * as the breakdown_t requests.
+ */
+typedef struct {
+    double heap_bytes;         /* mem_heapsize() + map_bytes */
+    double payload_bytes;      /* bytes requested by the live blocks */
+    double alloc_bytes;        /* bytes in allocated blocks + map_bytes */
+    double map_bytes;          /* mem_mapsize(): regions of their own */
+    double map_payload;        /* payload_bytes that lie in those regions */
+    double free_bytes;         /* bytes in free blocks */
+    double free_blocks;        /* number of free blocks */
+    double largest_free;       /* size of the largest free block */
+    double free_hist[NBUCKETS];/* number of free blocks per size bucket */
+} frag_t;
+
+/*
+ * The extension check (-X) replays a trace with the ids spread over the
+ * kinds of block below, and every EXT_CHECK_OPS requests resets the
+ * arena, compacts the heap and checks every live payload
+ */
+#define EXT_CHECK_OPS 256
+#define EXT_NONE   0 /* not live, or dropped by an arena reset */
+#define EXT_PLAIN  1 /* mm_malloc & co, grown with mm_try_expand */
+#define EXT_HANDLE 2 /* mm_halloc, moved by mm_compact */
+#define EXT_ARENA  3 /* mm_arena_alloc from the trace's arena */
+
+/* Points of a trace at which the fragmentation analysis looks at the heap */
+#define FRAG_PEAK 0 /* right after the live payload peaks */
+#define FRAG_END  1 /* after the last request */
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
     double ops;      /* number of ops (malloc/free/realloc) in the trace */
     int valid;       /* was the trace processed correctly by the allocator? */
     double secs;     /* number of secs needed to run the trace */
+    double overhead; /* secs the same replay takes against nullmm.c */
+    double noise;    /* (max-min)/min of secs over the timing repetitions */
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double rss_util; /* the same, against resident heap pages (0 for libc) */
+    mm_stats_t counters; /* mm.c internal counters from the util run */
+    breakdown_t breakdown; /* per op type and size cycles (only with -b) */
+    frag_t frag[2];  /* heap shape at FRAG_PEAK and FRAG_END (only with -F) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -91,6 +186,8 @@ typedef struct {
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
+static int reps = 1;    /* number of times each trace is timed (-r) */
+static int background = 0; /* run mm.c's maintenance thread (-B) */
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -106,32 +203,65 @@ static char *default_tracefiles[] = {
  *********************/
 
 /* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size, 
+static int add_range(range_t **ranges, char *lo, int size, int align,
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
 
-/* These functions read, allocate, and free storage for traces */
-static trace_t *read_trace(char *tracedir, char *filename);
-static void free_trace(trace_t *trace);
+/* These functions compile traces for the timed replay */
+static packed_t *pack_trace(trace_t *trace);
+static void free_packed(packed_t *packed);
+
+/* Measures the replay harness itself against the no-op engine */
+static void eval_null_speed(void *ptr);
+static void replay_touch(packed_t *pk, const engine_t *eng);
+static double time_trace(fsecs_test_funct f, speed_t *params, double *noise);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
 static void eval_libc_speed(void *ptr);
+static size_t libc_malloc_batch(size_t size, size_t n, void **out);
+static void libc_free_batch(void **ptrs, size_t n);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
+static int reset_heap(int discard);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_ext(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *rss_util);
+static void touch_pages(char *p, int size);
+static int find_peak_op(trace_t *trace);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_breakdown(speed_t *params, breakdown_t *bd);
+static void eval_mm_frag(trace_t *trace, frag_t frag[2]);
+static void compare_fits(char **tracefiles, int num_tracefiles, range_t **ranges,
+			 speed_t *speed_params);
+static void parse_fit(char *arg);
+static int size_bucket(int size);
 
 /* Various helper routines */
+static double netkops(double ops, double secs, double overhead);
 static void printresults(int n, stats_t *stats);
+static void printnoise(int n, stats_t *stats);
+static void printcounters(int n, stats_t *stats);
+static void printbreakdown(int n, stats_t *stats);
+static void printfrag(int n, stats_t *stats);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
 static void app_error(char *msg);
 
+/* The allocators replayed by replay_touch */
+static const engine_t mm_engine = {
+    mm_malloc, mm_calloc, mm_memalign, mm_realloc, mm_free,
+    mm_malloc_batch, mm_free_batch
+};
+static const engine_t libc_engine = {
+    malloc, calloc, aligned_alloc, realloc, free,
+    libc_malloc_batch, libc_free_batch
+};
+
 /**************
  * Main routine
  **************/
@@ -150,6 +280,14 @@ int main(int argc, char **argv)
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int pin_cpu = -1;    /* If >= 0, pin the process to this core (-c) */
+    int raise_prio = 0;  /* If set, raise the scheduling priority (-P) */
+    int lock_heap = 0;   /* If set, mlock the simulated heap (-L) */
+    int breakdown = 0;   /* If set, time each op type separately (-b) */
+    int frag = 0;        /* If set, analyze heap fragmentation (-F) */
+    int touch = 0;       /* If set, touch the payloads when timing (-T) */
+    int all_fits = 0;    /* If set, compare the placement policies (-A) */
+    int ext_check = 0;   /* If set, check the extension APIs as well (-X) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +296,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVgalc:PLr:bBFTm:p:AX")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -184,6 +322,45 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'c': /* Pin the timed runs to one core */
+            pin_cpu = atoi(optarg);
+            break;
+        case 'P': /* Raise the scheduling priority */
+            raise_prio = 1;
+            break;
+        case 'L': /* Lock the simulated heap into memory */
+            lock_heap = 1;
+            break;
+        case 'b': /* Break the time down by op type and size */
+            breakdown = 1;
+            break;
+        case 'B': /* Run mm.c's background maintenance thread */
+            background = 1;
+            break;
+        case 'F': /* Analyze the fragmentation of the heap */
+            frag = 1;
+            break;
+        case 'X': /* Check handles, mm_compact, mm_try_expand and arenas */
+            ext_check = 1;
+            break;
+        case 'm': /* Maximum size of the simulated heap, in MB */
+            if (atof(optarg) <= 0 || atof(optarg) * (1 << 20) > MAX_HEAP_LIMIT)
+		app_error("ERROR: -m needs a heap size between 0 and 4095 MB");
+            mem_set_max_heap((size_t)(atof(optarg) * (1 << 20)));
+            break;
+        case 'p': /* Placement policy of mm malloc */
+            parse_fit(optarg);
+            break;
+        case 'A': /* Compare all the placement policies */
+            all_fits = 1;
+            break;
+        case 'T': /* Write and read the payloads in the timed runs */
+            touch = 1;
+            break;
+        case 'r': /* Time each trace several times and report the noise */
+            if ((reps = atoi(optarg)) < 1)
+		app_error("ERROR: -r needs a positive repetition count");
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -238,6 +415,28 @@ int main(int argc, char **argv)
     /* Initialize the timing package */
     init_fsecs();
 
+    /* Initialize the simulated memory system in memlib.c */
+    mem_init(); 
+
+    /* 
+     * Stabilize the environment for the timed runs and describe it
+     */
+    if (pin_cpu >= 0 && runenv_pin_cpu(pin_cpu) < 0)
+	unix_error("ERROR: could not pin the driver to the requested cpu");
+    if (raise_prio && runenv_raise_priority() < 0)
+	printf("WARNING: could not raise the scheduling priority: %s\n",
+	       strerror(errno));
+    if (lock_heap && mem_lock() < 0) {
+	printf("WARNING: could not lock the simulated heap: %s\n",
+	       strerror(errno));
+	lock_heap = 0;
+    }
+    if (verbose || pin_cpu >= 0 || raise_prio || lock_heap)
+	runenv_print(pin_cpu, lock_heap);
+    speed_params.touch = touch;
+    if (touch && verbose)
+	printf("Timed runs write and read back every payload.\n");
+
     /*
      * Optionally run and evaluate the libc malloc package 
      */
@@ -252,6 +451,8 @@ int main(int argc, char **argv)
 	
 	/* Evaluate the libc malloc package using the K-best scheme */
 	for (i=0; i < num_tracefiles; i++) {
+	    if (verbose > 1)
+		printf("Reading tracefile: %s\n", tracefiles[i]);
 	    trace = read_trace(tracedir, tracefiles[i]);
 	    libc_stats[i].ops = trace->num_ops;
 	    if (verbose > 1)
@@ -259,9 +460,13 @@ int main(int argc, char **argv)
 	    libc_stats[i].valid = eval_libc_valid(trace, i);
 	    if (libc_stats[i].valid) {
 		speed_params.trace = trace;
+		speed_params.packed = pack_trace(trace);
 		if (verbose > 1)
 		    printf("and performance.\n");
-		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+		libc_stats[i].secs = time_trace(eval_libc_speed, &speed_params,
+						&libc_stats[i].noise);
+		libc_stats[i].overhead = fsecs(eval_null_speed, &speed_params);
+		free_packed(speed_params.packed);
 	    }
 	    free_trace(trace);
 	}
@@ -283,26 +488,40 @@ int main(int argc, char **argv)
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
-    
-    /* Initialize the simulated memory system in memlib.c */
-    mem_init(); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
+	if (verbose > 1)
+	    printf("Reading tracefile: %s\n", tracefiles[i]);
 	trace = read_trace(tracedir, tracefiles[i]);
 	mm_stats[i].ops = trace->num_ops;
 	if (verbose > 1)
 	    printf("Checking mm_malloc for correctness, ");
 	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	if (mm_stats[i].valid && ext_check) {
+	    if (verbose > 1)
+		printf("extensions, ");
+	    mm_stats[i].valid = eval_mm_ext(trace, i, &ranges);
+	}
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_stats[i].util = eval_mm_util(trace, i, &ranges,
+					    &mm_stats[i].rss_util);
+	    mm_get_stats(&mm_stats[i].counters);
+	    if (frag)
+		eval_mm_frag(trace, mm_stats[i].frag);
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
+	    speed_params.packed = pack_trace(trace);
 	    if (verbose > 1)
 		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    mm_stats[i].secs = time_trace(eval_mm_speed, &speed_params,
+					  &mm_stats[i].noise);
+	    mm_stats[i].overhead = fsecs(eval_null_speed, &speed_params);
+	    if (breakdown)
+		eval_mm_breakdown(&speed_params, &mm_stats[i].breakdown);
+	    free_packed(speed_params.packed);
 	}
 	free_trace(trace);
     }
@@ -311,9 +530,24 @@ int main(int argc, char **argv)
     if (verbose) {
 	printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
-	printf("\n");
+	printf("Simulated heap: %.0f KB committed, %.0f KB touched\n",
+	       mem_committed() / 1e3, mem_touched() / 1e3);
+	if (MM_STATS) {
+	    printf("\nAllocator counters for mm malloc:\n");
+	    printcounters(num_tracefiles, mm_stats);
+	}
     }
 
+    /* Display the analyses requested on the command line */
+    if (breakdown)
+	printbreakdown(num_tracefiles, mm_stats);
+    if (frag)
+	printfrag(num_tracefiles, mm_stats);
+    if (all_fits)
+	compare_fits(tracefiles, num_tracefiles, &ranges, &speed_params);
+    if (verbose || breakdown || frag || all_fits)
+	printf("\n");
+
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
      */
@@ -375,10 +609,11 @@ int main(int argc, char **argv)
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
- *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     size bytes at addr lo, which must be align-byte aligned. After
+ *     checking the block for correctness, we create a range struct for
+ *     this block and add it to the range list.
  */
-static int add_range(range_t **ranges, char *lo, int size, 
+static int add_range(range_t **ranges, char *lo, int size, int align,
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
@@ -387,23 +622,35 @@ static int add_range(range_t **ranges, char *lo, int size,
 
     assert(size > 0);
 
-    /* Payload addresses must be ALIGNMENT-byte aligned */
-    if (!IS_ALIGNED(lo)) {
+    /* Payload addresses must be aligned as requested */
+    if (!IS_ALIGNED(lo, align)) {
 	sprintf(msg, "Payload address (%p) not aligned to %d bytes", 
-		lo, ALIGNMENT);
+		lo, align);
         malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* 
+     * The payload must lie within the extent of the heap, or within a 
+     * region the allocator got from mem_map 
+     */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_in_map(lo, size)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
+    /* The block must hold at least the bytes that were asked for */
+    if (mm_usable_size(lo) < (size_t)size) {
+	sprintf(msg, "Payload (%p) has %lu usable bytes, fewer than %d",
+		lo, (unsigned long)mm_usable_size(lo), size);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
+    }
+
     /* The payload must not overlap any other payloads */
     for (p = *ranges;  p != NULL;  p = p->next) {
         if ((lo >= p->lo && lo <= p-> hi) ||
@@ -469,101 +716,125 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * pack_trace - compile a trace into the dense op stream replayed by
+ *     eval_mm_speed and eval_libc_speed
  */
-static trace_t *read_trace(char *tracedir, char *filename)
+static packed_t *pack_trace(trace_t *trace)
 {
-    FILE *tracefile;
-    trace_t *trace;
-    char type[MAXLINE];
-    char path[MAXLINE];
-    unsigned index, size;
-    unsigned max_index = 0;
-    unsigned op_index;
+    packed_t *pk;
+    int *id_slot;     /* slot currently holding each trace id */
+    int *free_slots;  /* stack of slots released by frees */
+    int *id_size;     /* current payload size of each trace id */
+    int num_free = 0;
+    int num_batch_slots = 0, max_batch = 0;
+    int i, k, n, id, slot, type, size;
+
+    if ((pk = (packed_t *)malloc(sizeof(packed_t))) == NULL)
+	unix_error("malloc 1 failed in pack_trace");
+    pk->num_ops = trace->num_ops;
+    pk->num_runs = 0;
+    pk->num_slots = 0;
+    pk->words = (unsigned *)malloc(trace->num_ops * sizeof(unsigned));
+    pk->slots = (unsigned *)malloc(trace->num_ops * sizeof(unsigned));
+    pk->args = (unsigned *)calloc(trace->num_ops, sizeof(unsigned));
+    pk->runs = (oprun_t *)malloc(trace->num_ops * sizeof(oprun_t));
+    id_slot = (int *)malloc(trace->num_ids * sizeof(int));
+    free_slots = (int *)malloc(trace->num_ids * sizeof(int));
+    id_size = (int *)calloc(trace->num_ids, sizeof(int));
+    if (pk->words == NULL || pk->slots == NULL || pk->args == NULL ||
+	pk->runs == NULL ||
+	id_slot == NULL || free_slots == NULL || id_size == NULL)
+	unix_error("malloc 2 failed in pack_trace");
+
+    /* Batch ops list the slots of all their ids */
+    for (i = 0; i < trace->num_ops; i++) {
+	if (PK_IS_BATCH(trace->ops[i].type)) {
+	    num_batch_slots += trace->ops[i].count;
+	    if (trace->ops[i].count > max_batch)
+		max_batch = trace->ops[i].count;
+	}
+    }
+    pk->batch_slots = (unsigned *)malloc((num_batch_slots + 1) * sizeof(unsigned));
+    pk->batch_ptrs = (void **)malloc((max_batch + 1) * sizeof(void *));
+    if (pk->batch_slots == NULL || pk->batch_ptrs == NULL)
+	unix_error("malloc 2 failed in pack_trace");
+    num_batch_slots = 0;
+
+    for (i = 0; i < trace->num_ids; i++)
+	id_slot[i] = -1;
+
+    for (i = 0; i < trace->num_ops; i++) {
+	type = trace->ops[i].type;
+	id = trace->ops[i].index;
+	n = PK_IS_BATCH(type) ? trace->ops[i].count : 1;
+	size = (type == FREE || type == BATCH_FREE) ? id_size[id] :
+	    trace->ops[i].size;
+	if ((unsigned)size > PK_SIZE_MASK)
+	    app_error("Request size too large for pack_trace");
+	if (PK_IS_BATCH(type)) {
+	    pk->slots[i] = num_batch_slots;
+	    pk->args[i] = n;
+	}
+	else if (type == MEMALIGN)
+	    pk->args[i] = trace->ops[i].align;
+
+	for (k = 0; k < n; k++) {
+	    if (type != FREE && type != BATCH_FREE)
+		id_size[id+k] = size;
+
+	    /* Give every newly live id a slot, reusing freed ones first */
+	    slot = id_slot[id+k];
+	    if (slot < 0) {
+		slot = (num_free > 0) ? free_slots[--num_free] : pk->num_slots++;
+		id_slot[id+k] = slot;
+	    }
+	    if (type == FREE || type == BATCH_FREE) {
+		free_slots[num_free++] = slot;
+		id_slot[id+k] = -1;
+	    }
 
-    if (verbose > 1)
-	printf("Reading tracefile: %s\n", filename);
+	    if (PK_IS_BATCH(type))
+		pk->batch_slots[num_batch_slots++] = slot;
+	    else
+		pk->slots[i] = slot;
+	}
+	pk->words[i] = PK_WORD(type, size);
 
-    /* Allocate the trace record */
-    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
-	unix_error("malloc 1 failed in read_trance");
-	
-    /* Read the trace file header */
-    strcpy(path, tracedir);
-    strcat(path, filename);
-    if ((tracefile = fopen(path, "r")) == NULL) {
-	sprintf(msg, "Could not open %s in read_trace", path);
-	unix_error(msg);
-    }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));     
-    fscanf(tracefile, "%d", &(trace->num_ops));     
-    fscanf(tracefile, "%d", &(trace->weight));        /* not used */
-    
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-	unix_error("malloc 2 failed in read_trace");
-
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks = 
-	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
-	unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes = 
-	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
-	unix_error("malloc 4 failed in read_trace");
-    
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-	switch(type[0]) {
-	case 'a':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = ALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'r':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = REALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'f':
-	    fscanf(tracefile, "%ud", &index);
-	    trace->ops[op_index].type = FREE;
-	    trace->ops[op_index].index = index;
-	    break;
-	default:
-	    printf("Bogus type character (%c) in tracefile %s\n", 
-		   type[0], path);
-	    exit(1);
+	/* Extend the current run or start a new one */
+	if (pk->num_runs > 0 && pk->runs[pk->num_runs-1].type == type) {
+	    pk->runs[pk->num_runs-1].end = i + 1;
+	}
+	else {
+	    pk->runs[pk->num_runs].type = type;
+	    pk->runs[pk->num_runs].start = i;
+	    pk->runs[pk->num_runs].end = i + 1;
+	    pk->num_runs++;
 	}
-	op_index++;
-	
     }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
-    
-    return trace;
+
+    if ((pk->slot_ptrs = (char **)malloc((pk->num_slots + 1) * sizeof(char *)))
+	== NULL)
+	unix_error("malloc 3 failed in pack_trace");
+
+    free(id_slot);
+    free(free_slots);
+    free(id_size);
+    return pk;
 }
 
 /*
- * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ * free_packed - Free a compiled op stream built by pack_trace()
  */
-void free_trace(trace_t *trace)
+static void free_packed(packed_t *pk)
 {
-    free(trace->ops);         /* free the three arrays... */
-    free(trace->blocks);      
-    free(trace->block_sizes);
-    free(trace);              /* and the trace record itself... */
+    free(pk->words);
+    free(pk->slots);
+    free(pk->args);
+    free(pk->batch_slots);
+    free(pk->batch_ptrs);
+    free(pk->runs);
+    free(pk->slot_ptrs);
+    free(pk);
 }
 
 /**********************************************************************
@@ -571,12 +842,33 @@ void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * reset_heap - Empty the simulated heap, dropping its pages if discard
+ *    is set, and call mm_init. With -B, mm.c's maintenance thread is
+ *    stopped across the reset, so that it never frees blocks of the old
+ *    heap into the new one.
+ */
+static int reset_heap(int discard)
+{
+    int ret;
+
+    if (background)
+	mm_stop_maintenance();
+    mem_reset_brk();
+    if (discard)
+	mem_discard();
+    ret = mm_init();
+    if (background && mm_start_maintenance() < 0)
+	app_error("mm_start_maintenance failed: build mm.c with MM_THREADS");
+    return ret;
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
 {
-    int i, j;
+    int i, j, n;
     int index;
     int size;
     int oldsize;
@@ -584,12 +876,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     char *oldp;
     char *p;
     
-    /* Reset the heap and free any records in the range list */
-    mem_reset_brk();
+    /* Free any records in the range list */
     clear_ranges(ranges);
 
-    /* Call the mm package's init function */
-    if (mm_init() < 0) {
+    /* Reset the heap and call the mm package's init function */
+    if (reset_heap(0) < 0) {
 	malloc_error(tracenum, 0, "mm_init failed.");
 	return 0;
     }
@@ -614,7 +905,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     * to the range list if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
-	    if (add_range(ranges, p, size, tracenum, i) == 0)
+	    if (add_range(ranges, p, size, ALIGNMENT, tracenum, i) == 0)
 		return 0;
 	    
 	    /* ADDED: cgw
@@ -629,6 +920,42 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    trace->block_sizes[index] = size;
 	    break;
 
+        case CALLOC: /* mm_calloc */
+
+	    if ((p = mm_calloc(1, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_calloc failed.");
+		return 0;
+	    }
+	    if (add_range(ranges, p, size, ALIGNMENT, tracenum, i) == 0)
+		return 0;
+
+	    /* The block must come back zeroed, whatever was there before */
+	    for (j = 0; j < size; j++) {
+		if (p[j] != 0) {
+		    malloc_error(tracenum, i, "mm_calloc did not zero the block");
+		    return 0;
+		}
+	    }
+	    memset(p, index & 0xFF, size);
+
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
+        case MEMALIGN: /* mm_memalign */
+
+	    if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_memalign failed.");
+		return 0;
+	    }
+	    if (add_range(ranges, p, size, trace->ops[i].align, tracenum, i) == 0)
+		return 0;
+	    memset(p, index & 0xFF, size);
+
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
         case REALLOC: /* mm_realloc */
 	    
 	    /* Call the student's realloc */
@@ -642,7 +969,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    remove_range(ranges, oldp);
 	    
 	    /* Check new block for correctness and add it to range list */
-	    if (add_range(ranges, newp, size, tracenum, i) == 0)
+	    if (add_range(ranges, newp, size, ALIGNMENT, tracenum, i) == 0)
 		return 0;
 	    
 	    /* ADDED: cgw
@@ -668,10 +995,36 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
         case FREE: /* mm_free */
 	    
-	    /* Remove region from list and call student's free function */
+	    /* Remove region from list and call student's free function,
+	     * passing the size so that it can check it */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    mm_free_sized(p, trace->block_sizes[index]);
+	    break;
+
+        case BATCH_ALLOC: /* mm_malloc_batch */
+
+	    /* The ids of a batch are consecutive, and so are their blocks[] */
+	    n = trace->ops[i].count;
+	    if (mm_malloc_batch(size, n, (void **)&trace->blocks[index]) !=
+		(size_t)n) {
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		return 0;
+	    }
+	    for (j = 0; j < n; j++) {
+		p = trace->blocks[index+j];
+		if (add_range(ranges, p, size, ALIGNMENT, tracenum, i) == 0)
+		    return 0;
+		memset(p, (index+j) & 0xFF, size);
+		trace->block_sizes[index+j] = size;
+	    }
+	    break;
+
+        case BATCH_FREE: /* mm_free_batch */
+	    n = trace->ops[i].count;
+	    for (j = 0; j < n; j++)
+		remove_range(ranges, trace->blocks[index+j]);
+	    mm_free_batch((void **)&trace->blocks[index], n);
 	    break;
 
 	default:
@@ -684,41 +1037,379 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     return 1;
 }
 
+/*
+ * ext_payload_ok - true if the first size bytes at p all hold the low
+ *     byte of index, which is what the replays fill payloads with
+ */
+static int ext_payload_ok(char *p, int size, int index)
+{
+    int j;
+
+    for (j = 0; j < size; j++)
+	if ((unsigned char)p[j] != (index & 0xFF))
+	    return 0;
+    return 1;
+}
+
+/*
+ * ext_free - give back the block of id index, whatever its kind, for
+ *     eval_mm_ext
+ */
+static void ext_free(trace_t *trace, range_t **ranges, int *kind,
+		     mm_handle_t *handles, mm_arena_t *arena, int index)
+{
+    switch (kind[index]) {
+    case EXT_PLAIN:
+	remove_range(ranges, trace->blocks[index]);
+	mm_free(trace->blocks[index]);
+	break;
+    case EXT_HANDLE:
+	remove_range(ranges, trace->blocks[index]);
+	mm_hfree(handles[index]);
+	break;
+    case EXT_ARENA:
+	mm_arena_free(arena, trace->blocks[index]);
+	break;
+    }
+    kind[index] = EXT_NONE;
+}
+
+/*
+ * ext_checkpoint - the periodic check of eval_mm_ext, made after request
+ *     opnum. The arena objects are checked and the arena reset, then the
+ *     heap is compacted with the handles of every fourth id locked. Every
+ *     other payload must still hold its bytes, the locked blocks must not
+ *     have moved, and the range list is rebuilt from where the blocks are
+ *     now. Returns 0 after reporting an error.
+ */
+static int ext_checkpoint(trace_t *trace, int tracenum, int opnum,
+			  range_t **ranges, int *kind, mm_handle_t *handles,
+			  mm_arena_t *arena)
+{
+    int index, size;
+    char *p;
+
+    for (index = 0; index < trace->num_ids; index++) {
+	if (kind[index] == EXT_ARENA) {
+	    if (!ext_payload_ok(trace->blocks[index],
+				trace->block_sizes[index], index)) {
+		malloc_error(tracenum, opnum, "an arena object lost its data");
+		return 0;
+	    }
+	    kind[index] = EXT_NONE;
+	}
+	else if (kind[index] == EXT_HANDLE && index % 4 == 0)
+	    mm_hlock(handles[index]);
+    }
+    mm_arena_reset(arena);
+    mm_compact();
+
+    clear_ranges(ranges);
+    for (index = 0; index < trace->num_ids; index++) {
+	if (kind[index] == EXT_HANDLE) {
+	    p = mm_hlock(handles[index]);
+	    mm_hunlock(handles[index]);
+	    if (index % 4 == 0) {
+		mm_hunlock(handles[index]);
+		if (p != trace->blocks[index]) {
+		    malloc_error(tracenum, opnum, "mm_compact moved a locked block");
+		    return 0;
+		}
+	    }
+	    trace->blocks[index] = p;
+	}
+	else if (kind[index] != EXT_PLAIN)
+	    continue;
+
+	p = trace->blocks[index];
+	size = trace->block_sizes[index];
+	if (add_range(ranges, p, size, ALIGNMENT, tracenum, opnum) == 0)
+	    return 0;
+	if (!ext_payload_ok(p, size, index)) {
+	    malloc_error(tracenum, opnum, "mm_compact did not preserve a payload");
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/*
+ * eval_mm_ext - Check the extension APIs of the mm malloc package (-X).
+ *     The trace is replayed with one in three of the ids that mm_malloc
+ *     would get allocated through a handle, and one in three from an
+ *     arena; reallocs of handles and arena objects allocate anew and
+ *     copy, while those of the other blocks try mm_try_expand before
+ *     mm_realloc. Every EXT_CHECK_OPS requests, and at the end,
+ *     ext_checkpoint compacts the heap and checks the blocks.
+ */
+static int eval_mm_ext(trace_t *trace, int tracenum, range_t **ranges)
+{
+    int i, j, n, index, size, align, ok = 0;
+    int *kind;
+    mm_handle_t *handles, h;
+    mm_arena_t *arena;
+    char *p, *oldp;
+    size_t usable;
+
+    clear_ranges(ranges);
+    if (reset_heap(0) < 0) {
+	malloc_error(tracenum, 0, "mm_init failed.");
+	return 0;
+    }
+    if ((kind = (int *)calloc(trace->num_ids, sizeof(int))) == NULL ||
+	(handles = (mm_handle_t *)malloc(trace->num_ids *
+					 sizeof(mm_handle_t))) == NULL)
+	unix_error("ERROR: malloc failed in eval_mm_ext");
+    if ((arena = mm_arena_create()) == NULL) {
+	malloc_error(tracenum, 0, "mm_arena_create failed.");
+	goto out;
+    }
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	align = ALIGNMENT;
+	p = NULL;
+
+	switch (trace->ops[i].type) {
+
+	case ALLOC:
+	    if (index % 3 == 1) {
+		if ((handles[index] = mm_halloc(size)) < 0) {
+		    malloc_error(tracenum, i, "mm_halloc failed.");
+		    goto out;
+		}
+		p = mm_hlock(handles[index]);
+		mm_hunlock(handles[index]);
+		kind[index] = EXT_HANDLE;
+	    }
+	    else if (index % 3 == 2) {
+		if ((p = mm_arena_alloc(arena, size)) == NULL) {
+		    malloc_error(tracenum, i, "mm_arena_alloc failed.");
+		    goto out;
+		}
+		kind[index] = EXT_ARENA;
+	    }
+	    else {
+		if ((p = mm_malloc(size)) == NULL) {
+		    malloc_error(tracenum, i, "mm_malloc failed.");
+		    goto out;
+		}
+		kind[index] = EXT_PLAIN;
+	    }
+	    break;
+
+	case CALLOC:
+	    if ((p = mm_calloc(1, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_calloc failed.");
+		goto out;
+	    }
+	    kind[index] = EXT_PLAIN;
+	    break;
+
+	case MEMALIGN:
+	    align = trace->ops[i].align;
+	    if ((p = mm_memalign(align, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_memalign failed.");
+		goto out;
+	    }
+	    kind[index] = EXT_PLAIN;
+	    break;
+
+	case REALLOC:
+	    oldp = trace->blocks[index];
+	    n = trace->block_sizes[index];
+	    if (size < n)
+		n = size;
+
+	    switch (kind[index]) {
+	    case EXT_PLAIN:
+		/* Grown where it is, the block must not have moved */
+		if ((usable = mm_try_expand(oldp, size, size)) != 0) {
+		    if (usable < (size_t)size || usable != mm_usable_size(oldp)) {
+			malloc_error(tracenum, i, "mm_try_expand returned "
+				     "a wrong usable size");
+			goto out;
+		    }
+		    p = oldp;
+		}
+		else if ((p = mm_realloc(oldp, size)) == NULL) {
+		    malloc_error(tracenum, i, "mm_realloc failed.");
+		    goto out;
+		}
+		remove_range(ranges, oldp);
+		break;
+
+	    case EXT_HANDLE:
+		if ((h = mm_halloc(size)) < 0) {
+		    malloc_error(tracenum, i, "mm_halloc failed.");
+		    goto out;
+		}
+		p = mm_hlock(h);
+		memcpy(p, mm_hlock(handles[index]), n);
+		mm_hunlock(handles[index]);
+		mm_hunlock(h);
+		remove_range(ranges, oldp);
+		mm_hfree(handles[index]);
+		handles[index] = h;
+		break;
+
+	    default:
+		/*
+		 * A freed arena object is reused only if it was the last one,
+		 * in which case the new one starts at the same address
+		 */
+		if (kind[index] == EXT_ARENA)
+		    mm_arena_free(arena, oldp);
+		else
+		    n = 0; /* dropped by the last arena reset */
+		if ((p = mm_arena_alloc(arena, size)) == NULL) {
+		    malloc_error(tracenum, i, "mm_arena_alloc failed.");
+		    goto out;
+		}
+		memmove(p, oldp, n);
+		kind[index] = EXT_ARENA;
+		break;
+	    }
+
+	    if (!ext_payload_ok(p, n, index)) {
+		malloc_error(tracenum, i, "realloc did not preserve the "
+			     "data from old block");
+		goto out;
+	    }
+	    break;
+
+	case FREE:
+	    ext_free(trace, ranges, kind, handles, arena, index);
+	    break;
+
+	case BATCH_ALLOC:
+	    n = trace->ops[i].count;
+	    if (mm_malloc_batch(size, n, (void **)&trace->blocks[index]) !=
+		(size_t)n) {
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		goto out;
+	    }
+	    for (j = 0; j < n; j++) {
+		p = trace->blocks[index+j];
+		if (add_range(ranges, p, size, ALIGNMENT, tracenum, i) == 0)
+		    goto out;
+		memset(p, (index+j) & 0xFF, size);
+		trace->block_sizes[index+j] = size;
+		kind[index+j] = EXT_PLAIN;
+	    }
+	    p = NULL;
+	    break;
+
+	case BATCH_FREE:
+	    for (j = 0; j < trace->ops[i].count; j++)
+		ext_free(trace, ranges, kind, handles, arena, index+j);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_ext");
+	}
+
+	/* Check and remember a block just handed out, and fill it */
+	if (p != NULL) {
+	    if (kind[index] != EXT_ARENA &&
+		add_range(ranges, p, size, align, tracenum, i) == 0)
+		goto out;
+	    memset(p, index & 0xFF, size);
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	}
+
+	if ((i + 1) % EXT_CHECK_OPS == 0 &&
+	    !ext_checkpoint(trace, tracenum, i, ranges, kind, handles, arena))
+	    goto out;
+    }
+    if (!ext_checkpoint(trace, tracenum, trace->num_ops - 1, ranges, kind,
+			handles, arena))
+	goto out;
+
+    for (index = 0; index < trace->num_ids; index++)
+	ext_free(trace, ranges, kind, handles, arena, index);
+    mm_arena_destroy(arena);
+    ok = 1;
+
+ out:
+    free(kind);
+    free(handles);
+    clear_ranges(ranges);
+    return ok;
+}
+
+/*
+ * touch_pages - write one byte in every page of the size bytes at p
+ */
+static void touch_pages(char *p, int size)
+{
+    int j, pagesize = (int)mem_pagesize();
+
+    for (j = 0; j < size; j += pagesize)
+	p[j] = 0;
+    if (size > 0)
+	p[size - 1] = 0;
+}
+
 /* 
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
- *   
+ *   high water mark of the heap size while running the student's
+ *   malloc package on the trace: mem_trim() can lower the brk pointer,
+ *   but not the footprint the heap once had. Regions the allocator
+ *   maps outside the heap with mem_map count towards heapsize too:
+ *   it is the high water mark of the heap size plus the mapped bytes.
+ *
+ *   *rss_util is set to the same ratio against the bytes in heap pages
+ *   and regions that are actually resident. All pages are discarded
+ *   before the run, every page of a payload is written when it is
+ *   handed out, as the application would, and residency is sampled
+ *   with mem_touched() right after the request at which the live
+ *   payload peaks and at the end of the trace; the larger sample is
+ *   used. The live payload is then resident, so a ratio above 1 is an
+ *   error.
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *rss_util)
 {   
-    int i;
+    int i, j, n;
     int index;
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    int peak_op;
+    size_t resident = 0, touched;
     char *p;
     char *newp, *oldp;
 
+    peak_op = find_peak_op(trace);
+
     /* initialize the heap and the mm malloc package */
-    mem_reset_brk();
-    if (mm_init() < 0)
+    if (reset_heap(1) < 0)
 	app_error("mm_init failed in eval_mm_util");
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if (trace->ops[i].type == CALLOC)
+		p = mm_calloc(1, size);
+	    else if (trace->ops[i].type == MEMALIGN)
+		p = mm_memalign(trace->ops[i].align, size);
+	    else
+		p = mm_malloc(size);
+	    if (p == NULL)
 		app_error("mm_malloc failed in eval_mm_util");
+	    touch_pages(p, size);
 	    
 	    /* Remember region and size */
 	    trace->blocks[index] = p;
@@ -741,6 +1432,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    oldp = trace->blocks[index];
 	    if ((newp = mm_realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
+	    touch_pages(newp, newsize);
 
 	    /* Remember region and size */
 	    trace->blocks[index] = newp;
@@ -768,60 +1460,673 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    break;
 
+        case BATCH_ALLOC: /* mm_malloc_batch */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    n = trace->ops[i].count;
+
+	    if (mm_malloc_batch(size, n, (void **)&trace->blocks[index]) !=
+		(size_t)n)
+		app_error("mm_malloc_batch failed in eval_mm_util");
+	    for (j = 0; j < n; j++) {
+		touch_pages(trace->blocks[index+j], size);
+		trace->block_sizes[index+j] = size;
+	    }
+
+	    total_size += n * size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+        case BATCH_FREE: /* mm_free_batch */
+	    index = trace->ops[i].index;
+	    n = trace->ops[i].count;
+	    for (j = 0; j < n; j++)
+		total_size -= trace->block_sizes[index+j];
+	    mm_free_batch((void **)&trace->blocks[index], n);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+
+	if (i == peak_op)
+	    resident = mem_touched();
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
-}
+    touched = mem_touched();
+    resident = (touched > resident) ? touched : resident;
+    *rss_util = (resident > 0) ? (double)max_total_size / (double)resident : 0;
+    if (*rss_util > 1.0)
+	malloc_error(tracenum, peak_op,
+		     "live payload exceeds the resident bytes in eval_mm_util");
 
+    return ((double)max_total_size / 
+	    (double)mem_footprint_hwm());
+}
 
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * find_peak_op - Return the index of the request after which the total
+ *    payload of the live blocks of a trace is largest (-1 if it never
+ *    grows). Clobbers trace->block_sizes.
  */
-static void eval_mm_speed(void *ptr)
+static int find_peak_op(trace_t *trace)
 {
-    int i, index, size, newsize;
-    char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
+    int i, j, index, peak_op = -1;
+    double total_size = 0, max_total_size = 0;
 
-    /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
-    if (mm_init() < 0) 
-	app_error("mm_init failed in eval_mm_speed");
-
-    /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
         switch (trace->ops[i].type) {
+        case ALLOC:
+        case CALLOC:
+        case MEMALIGN:
+	    total_size += trace->ops[i].size;
+	    break;
+	case REALLOC:
+	    total_size += trace->ops[i].size - (double)trace->block_sizes[index];
+	    break;
+	case FREE:
+	    total_size -= trace->block_sizes[index];
+	    break;
+	case BATCH_ALLOC:
+	    for (j = 0; j < trace->ops[i].count; j++)
+		trace->block_sizes[index+j] = trace->ops[i].size;
+	    total_size += (double)trace->ops[i].count * trace->ops[i].size;
+	    break;
+	case BATCH_FREE:
+	    for (j = 0; j < trace->ops[i].count; j++)
+		total_size -= trace->block_sizes[index+j];
+	    break;
+	}
+	if (trace->ops[i].type != FREE && !PK_IS_BATCH(trace->ops[i].type))
+	    trace->block_sizes[index] = trace->ops[i].size;
+	if (total_size > max_total_size) {
+	    max_total_size = total_size;
+	    peak_op = i;
+	}
+    }
+    return peak_op;
+}
 
-        case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-		app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
+
+/*
+ * frag_visit - mm_heap_walk callback that accumulates one block into
+ *    the frag_t passed as arg
+ */
+static void frag_visit(void *block, size_t size, int allocated, void *arg)
+{
+    frag_t *f = (frag_t *)arg;
+
+    if (allocated) {
+	f->alloc_bytes += size;
+	return;
+    }
+    f->free_bytes += size;
+    f->free_blocks++;
+    f->free_hist[size_bucket(size)]++;
+    if (size > f->largest_free)
+	f->largest_free = size;
+}
+
+/*
+ * frag_snapshot - fill in f from a walk of the heap. mm_heap_walk only
+ *    sees the heap, so the mem_map regions are added to it by hand.
+ */
+static void frag_snapshot(frag_t *f, double payload, double map_payload)
+{
+    f->map_bytes = mem_mapsize();
+    f->map_payload = map_payload;
+    f->heap_bytes = mem_heapsize() + f->map_bytes;
+    f->payload_bytes = payload;
+    f->alloc_bytes = f->map_bytes;
+    mm_heap_walk(frag_visit, f);
+}
+
+/*
+ * eval_mm_frag - Replay the trace and walk the heap with mm_heap_walk
+ *    right after the request at which the live payload peaks, and again
+ *    at the end of the trace. Internal fragmentation is the difference
+ *    between the bytes in allocated blocks and the bytes requested;
+ *    external fragmentation is measured from the free blocks. Blocks
+ *    with a region of their own count as allocated bytes, and are also
+ *    tallied apart.
+ */
+static void eval_mm_frag(trace_t *trace, frag_t frag[2])
+{
+    int i, j, index, peak_op;
+    double total_size = 0, map_size = 0;
+    char *p;
+
+    peak_op = find_peak_op(trace);
+
+    memset(frag, 0, 2 * sizeof(frag_t));
+    if (reset_heap(0) < 0)
+	app_error("mm_init failed in eval_mm_frag");
+
+    total_size = 0;
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+        case ALLOC:
+        case CALLOC:
+        case MEMALIGN:
+	    if (trace->ops[i].type == CALLOC)
+		p = mm_calloc(1, trace->ops[i].size);
+	    else if (trace->ops[i].type == MEMALIGN)
+		p = mm_memalign(trace->ops[i].align, trace->ops[i].size);
+	    else
+		p = mm_malloc(trace->ops[i].size);
+	    if (p == NULL)
+		app_error("mm_malloc failed in eval_mm_frag");
+	    trace->blocks[index] = p;
+	    total_size += trace->ops[i].size;
+	    if (mem_in_map(p, 1))
+		map_size += trace->ops[i].size;
+	    trace->block_sizes[index] = trace->ops[i].size;
+	    break;
+	case REALLOC:
+	    if (mem_in_map(trace->blocks[index], 1))
+		map_size -= trace->block_sizes[index];
+	    if ((p = mm_realloc(trace->blocks[index], 
+				trace->ops[i].size)) == NULL)
+		app_error("mm_realloc failed in eval_mm_frag");
+	    trace->blocks[index] = p;
+	    total_size += trace->ops[i].size - (double)trace->block_sizes[index];
+	    if (mem_in_map(p, 1))
+		map_size += trace->ops[i].size;
+	    trace->block_sizes[index] = trace->ops[i].size;
+	    break;
+	case FREE:
+	    if (mem_in_map(trace->blocks[index], 1))
+		map_size -= trace->block_sizes[index];
+	    mm_free(trace->blocks[index]);
+	    total_size -= trace->block_sizes[index];
+	    break;
+	case BATCH_ALLOC:
+	    if (mm_malloc_batch(trace->ops[i].size, trace->ops[i].count,
+				(void **)&trace->blocks[index]) !=
+		(size_t)trace->ops[i].count)
+		app_error("mm_malloc_batch failed in eval_mm_frag");
+	    for (j = 0; j < trace->ops[i].count; j++) {
+		trace->block_sizes[index+j] = trace->ops[i].size;
+		if (mem_in_map(trace->blocks[index+j], 1))
+		    map_size += trace->ops[i].size;
+	    }
+	    total_size += (double)trace->ops[i].count * trace->ops[i].size;
+	    break;
+	case BATCH_FREE:
+	    for (j = 0; j < trace->ops[i].count; j++) {
+		total_size -= trace->block_sizes[index+j];
+		if (mem_in_map(trace->blocks[index+j], 1))
+		    map_size -= trace->block_sizes[index+j];
+	    }
+	    mm_free_batch((void **)&trace->blocks[index], trace->ops[i].count);
+	    break;
+	default:
+	    app_error("Nonexistent request type in eval_mm_frag");
+	}
+
+	if (i == peak_op)
+	    frag_snapshot(&frag[FRAG_PEAK], total_size, map_size);
+    }
+
+    frag_snapshot(&frag[FRAG_END], total_size, map_size);
+}
+
+/*
+ * compare_fits - run the traces once with each placement policy of mm.c
+ *     and print their utilization and throughput side by side. The
+ *     other policy knobs keep their current values. Errors found along
+ *     the way are reported per policy and do not count against the main
+ *     run.
+ */
+static void compare_fits(char **tracefiles, int num_tracefiles, range_t **ranges,
+			 speed_t *speed_params)
+{
+    char *names[] = MM_FIT_NAMES;
+    mm_params_t saved, params;
+    trace_t *trace;
+    double secs, ops, util, noise, thru, perfindex;
+    int fit, i, valid, saved_errors = errors;
+
+    mm_get_params(&saved);
+    printf("\nPlacement policies for mm malloc:\n");
+    printf("%-10s%7s%8s%10s%7s\n", "policy", "valid", "util", "Kops", "perf");
+    for (fit = 0; fit < MM_FIT_POLICIES; fit++) {
+	params = saved;
+	params.fit = fit;
+	if (mm_set_params(&params) < 0)
+	    app_error("ERROR: mm_set_params rejected a placement policy");
+
+	secs = ops = util = 0;
+	valid = 0;
+	errors = 0;
+	for (i = 0; i < num_tracefiles; i++) {
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    if (eval_mm_valid(trace, i, ranges)) {
+		valid++;
+		util += eval_mm_util(trace, i, ranges, &noise);
+		speed_params->trace = trace;
+		speed_params->ranges = *ranges;
+		speed_params->packed = pack_trace(trace);
+		secs += time_trace(eval_mm_speed, speed_params, &noise);
+		ops += trace->num_ops;
+		free_packed(speed_params->packed);
+	    }
+	    free_trace(trace);
+	}
+
+	if (fit == MM_FIT_GOOD)
+	    sprintf(msg, "%s(%d)", names[fit], params.fit_k);
+	else
+	    strcpy(msg, names[fit]);
+	if (errors > 0 || secs == 0) {
+	    printf("%-10s%4d/%-2d%8s%10s%7s\n", msg, valid, num_tracefiles,
+		   "-", "-", "-");
+	    continue;
+	}
+	thru = ops / secs;
+	perfindex = (UTIL_WEIGHT * util / num_tracefiles +
+		     (1.0 - UTIL_WEIGHT) * 
+		     (thru < AVG_LIBC_THRUPUT ? thru / AVG_LIBC_THRUPUT : 1.0)) * 100.0;
+	printf("%-10s%4d/%-2d%7.1f%%%10.0f%7.1f\n", msg, valid, num_tracefiles,
+	       util / num_tracefiles * 100.0, thru / 1e3, perfindex);
+    }
+
+    errors = saved_errors;
+    mm_set_params(&saved);
+}
+
+/*
+ * parse_fit - set the placement policy from a -p argument, which is a
+ *     name from MM_FIT_NAMES, optionally followed by :K for good fit
+ */
+static void parse_fit(char *arg)
+{
+    char *names[] = MM_FIT_NAMES;
+    char *colon = strchr(arg, ':');
+    mm_params_t params;
+    int fit;
+
+    mm_get_params(&params);
+    if (colon != NULL) {
+	*colon = '\0';
+	params.fit_k = atoi(colon + 1);
+    }
+    for (fit = 0; fit < MM_FIT_POLICIES; fit++)
+	if (!strcmp(arg, names[fit]))
+	    break;
+    params.fit = fit;
+    if (mm_set_params(&params) < 0)
+	app_error("ERROR: -p needs first, next, best or good[:K] with K > 0");
+}
+
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package. It replays
+ *    the packed op stream built by pack_trace() so that as little of
+ *    the measured time as possible is spent in the driver itself.
+ */
+static void eval_mm_speed(void *ptr)
+{
+    packed_t *pk = ((speed_t *)ptr)->packed;
+    unsigned *words = pk->words;
+    unsigned *slots = pk->slots;
+    char **blocks = pk->slot_ptrs;
+    void **ptrs = pk->batch_ptrs;
+    unsigned *bslots, k;
+    oprun_t *run, *last_run = pk->runs + pk->num_runs;
+    int i;
+
+    /* Reset the heap and initialize the mm package */
+    if (reset_heap(0) < 0) 
+	app_error("mm_init failed in eval_mm_speed");
+
+    if (((speed_t *)ptr)->touch) {
+	replay_touch(pk, &mm_engine);
+	return;
+    }
+
+    /* Interpret each run of trace requests */
+    for (run = pk->runs;  run < last_run;  run++)
+        switch (run->type) {
+
+        case ALLOC: /* mm_malloc */
+	    for (i = run->start;  i < run->end;  i++)
+		if ((blocks[slots[i]] = mm_malloc(PK_SIZE(words[i]))) == NULL)
+		    app_error("mm_malloc error in eval_mm_speed");
+            break;
+
+        case CALLOC: /* mm_calloc */
+	    for (i = run->start;  i < run->end;  i++)
+		if ((blocks[slots[i]] = mm_calloc(1, PK_SIZE(words[i]))) == NULL)
+		    app_error("mm_calloc error in eval_mm_speed");
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+	    for (i = run->start;  i < run->end;  i++)
+		if ((blocks[slots[i]] = mm_memalign(pk->args[i],
+						    PK_SIZE(words[i]))) == NULL)
+		    app_error("mm_memalign error in eval_mm_speed");
             break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL)
-		app_error("mm_realloc error in eval_mm_speed");
-            trace->blocks[index] = newp;
+	    for (i = run->start;  i < run->end;  i++)
+		if ((blocks[slots[i]] = mm_realloc(blocks[slots[i]],
+						   PK_SIZE(words[i]))) == NULL)
+		    app_error("mm_realloc error in eval_mm_speed");
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            block = trace->blocks[index];
-            mm_free(block);
+	    for (i = run->start;  i < run->end;  i++)
+		mm_free(blocks[slots[i]]);
+            break;
+
+        case BATCH_ALLOC: /* mm_malloc_batch */
+	    for (i = run->start;  i < run->end;  i++) {
+		bslots = pk->batch_slots + slots[i];
+		if (mm_malloc_batch(PK_SIZE(words[i]), pk->args[i], ptrs) != pk->args[i])
+		    app_error("mm_malloc_batch error in eval_mm_speed");
+		for (k = 0; k < pk->args[i]; k++)
+		    blocks[bslots[k]] = ptrs[k];
+	    }
+            break;
+
+        case BATCH_FREE: /* mm_free_batch */
+	    for (i = run->start;  i < run->end;  i++) {
+		bslots = pk->batch_slots + slots[i];
+		for (k = 0; k < pk->args[i]; k++)
+		    ptrs[k] = blocks[bslots[k]];
+		mm_free_batch(ptrs, pk->args[i]);
+	    }
             break;
 
 	default:
-	    app_error("Nonexistent request type in eval_mm_valid");
+	    app_error("Nonexistent request type in eval_mm_speed");
+        }
+}
+
+/*
+ * time_trace - Time f on a trace reps times with fsecs and return the
+ *    fastest run. *noise is set to the spread (max-min)/min of the runs,
+ *    which is 0 when the trace is only timed once.
+ */
+static double time_trace(fsecs_test_funct f, speed_t *params, double *noise)
+{
+    int i;
+    double secs, min_secs = DBL_MAX, max_secs = 0;
+
+    for (i = 0; i < reps; i++) {
+	secs = fsecs(f, params);
+	min_secs = (secs < min_secs) ? secs : min_secs;
+	max_secs = (secs > max_secs) ? secs : max_secs;
+    }
+    *noise = (min_secs > 0) ? (max_secs - min_secs) / min_secs : 0;
+    return min_secs;
+}
+
+/*
+ * size_bucket - index of the breakdown_t bucket for a request size
+ */
+static int size_bucket(int size)
+{
+    int b = 0;
+    int limit = 16;
+
+    while (b < NBUCKETS-1 && size > limit) {
+	limit *= 4;
+	b++;
+    }
+    return b;
+}
+
+/*
+ * eval_mm_breakdown - Replay the packed op stream once more, reading the
+ *    cycle counter around every request, and charge the cycles to the
+ *    request's type and size bucket. Frees are charged to the size of
+ *    the block they release. This run is not timed by fsecs, so the
+ *    counter reads do not disturb the throughput figures.
+ */
+static void eval_mm_breakdown(speed_t *params, breakdown_t *bd)
+{
+    packed_t *pk = params->packed;
+    char **blocks = pk->slot_ptrs;
+    void **ptrs = pk->batch_ptrs;
+    unsigned *bslots, k;
+    int i, type, size, slot, bucket;
+    double start, cycles, read_ovhd = DBL_MAX;
+
+    memset(bd, 0, sizeof(*bd));
+
+    /* Calibrate the cost of a back-to-back pair of counter reads */
+    for (i = 0; i < 100; i++) {
+	start = read_counter();
+	cycles = read_counter() - start;
+	read_ovhd = (cycles < read_ovhd) ? cycles : read_ovhd;
+    }
+
+    if (reset_heap(0) < 0) 
+	app_error("mm_init failed in eval_mm_breakdown");
+
+    for (i = 0;  i < pk->num_ops;  i++) {
+	type = PK_TYPE(pk->words[i]);
+	slot = pk->slots[i];
+	size = PK_SIZE(pk->words[i]);
+
+	start = read_counter();
+        switch (type) {
+        case ALLOC:
+	    blocks[slot] = mm_malloc(size);
+	    break;
+        case CALLOC:
+	    blocks[slot] = mm_calloc(1, size);
+	    break;
+        case MEMALIGN:
+	    blocks[slot] = mm_memalign(pk->args[i], size);
+	    break;
+	case REALLOC:
+	    blocks[slot] = mm_realloc(blocks[slot], size);
+	    break;
+        case FREE:
+	    mm_free(blocks[slot]);
+	    break;
+        case BATCH_ALLOC:
+	    if (mm_malloc_batch(size, pk->args[i], ptrs) != pk->args[i])
+		app_error("allocation error in eval_mm_breakdown");
+	    break;
+        case BATCH_FREE:
+	    bslots = pk->batch_slots + slot;
+	    for (k = 0; k < pk->args[i]; k++)
+		ptrs[k] = blocks[bslots[k]];
+	    mm_free_batch(ptrs, pk->args[i]);
+	    break;
+	}
+	cycles = read_counter() - start - read_ovhd;
+
+	/* Storing a batch's blocks is not charged to the allocator */
+	if (type == BATCH_ALLOC) {
+	    bslots = pk->batch_slots + slot;
+	    for (k = 0; k < pk->args[i]; k++)
+		blocks[bslots[k]] = ptrs[k];
+	}
+	else if (type != FREE && type != BATCH_FREE && blocks[slot] == NULL)
+	    app_error("allocation error in eval_mm_breakdown");
+
+	bucket = size_bucket(size);
+	bd->count[type][bucket]++;
+	bd->cycles[type][bucket] += (cycles > 0) ? cycles : 0;
+    }
+}
+
+/* Where replay_touch stores what it read, so the reads are not optimized out */
+volatile char touch_sink;
+
+/*
+ * replay_touch - Replay the packed op stream like an application would
+ *    use the blocks: every payload handed out by alloc or resize is
+ *    written, and every payload is read back before release. The cost
+ *    of these accesses depends on where the allocator put the blocks,
+ *    so they reflect the cache and TLB behaviour of its placement.
+ */
+static void replay_touch(packed_t *pk, const engine_t *eng)
+{
+    unsigned *words = pk->words;
+    unsigned *slots = pk->slots;
+    char **blocks = pk->slot_ptrs;
+    void **ptrs = pk->batch_ptrs;
+    unsigned *bslots;
+    char sum = 0;
+    char *p;
+    unsigned j, k, size;
+    int i;
+
+    for (i = 0;  i < pk->num_ops;  i++) {
+	size = PK_SIZE(words[i]);
+        switch (PK_TYPE(words[i])) {
+        case ALLOC:
+	    if ((p = eng->malloc(size)) == NULL)
+		app_error("allocation failed in replay_touch");
+	    for (j = 0; j < size; j += TOUCH_STRIDE)
+		p[j] = (char)j;
+	    blocks[slots[i]] = p;
+	    break;
+
+        case CALLOC:
+	    if ((p = eng->calloc(1, size)) == NULL)
+		app_error("allocation failed in replay_touch");
+	    for (j = 0; j < size; j += TOUCH_STRIDE)
+		p[j] = (char)j;
+	    blocks[slots[i]] = p;
+	    break;
+
+        case MEMALIGN:
+	    if ((p = eng->memalign(pk->args[i], size)) == NULL)
+		app_error("allocation failed in replay_touch");
+	    for (j = 0; j < size; j += TOUCH_STRIDE)
+		p[j] = (char)j;
+	    blocks[slots[i]] = p;
+	    break;
+
+	case REALLOC:
+	    if ((p = eng->realloc(blocks[slots[i]], size)) == NULL)
+		app_error("reallocation failed in replay_touch");
+	    for (j = 0; j < size; j += TOUCH_STRIDE)
+		p[j] = (char)j;
+	    blocks[slots[i]] = p;
+	    break;
+
+        case FREE:
+	    p = blocks[slots[i]];
+	    for (j = 0; j < size; j += TOUCH_STRIDE)
+		sum += p[j];
+	    eng->free(p);
+	    break;
+
+        case BATCH_ALLOC:
+	    bslots = pk->batch_slots + slots[i];
+	    if (eng->malloc_batch(size, pk->args[i], ptrs) != pk->args[i])
+		app_error("allocation failed in replay_touch");
+	    for (k = 0; k < pk->args[i]; k++) {
+		p = ptrs[k];
+		for (j = 0; j < size; j += TOUCH_STRIDE)
+		    p[j] = (char)j;
+		blocks[bslots[k]] = p;
+	    }
+	    break;
+
+        case BATCH_FREE:
+	    /* The ids may differ in size, so only their first bytes are read */
+	    bslots = pk->batch_slots + slots[i];
+	    for (k = 0; k < pk->args[i]; k++) {
+		ptrs[k] = blocks[bslots[k]];
+		sum += *(char *)ptrs[k];
+	    }
+	    eng->free_batch(ptrs, pk->args[i]);
+	    break;
+	}
+    }
+    touch_sink = sum;
+}
+
+/*
+ * eval_null_speed - This is the function that is used by fcyc() to
+ *    measure the cost of the replay harness. It runs exactly the same
+ *    loops as eval_mm_speed, but against the no-op engine in nullmm.c,
+ *    so the time it takes is the part of the gross time that is not
+ *    spent in the allocator. The no-op engine has no memory behind its
+ *    blocks, so it never touches them: in touch mode the net time
+ *    includes the payload accesses.
+ */
+static void eval_null_speed(void *ptr)
+{
+    packed_t *pk = ((speed_t *)ptr)->packed;
+    unsigned *words = pk->words;
+    unsigned *slots = pk->slots;
+    char **blocks = pk->slot_ptrs;
+    void **ptrs = pk->batch_ptrs;
+    unsigned *bslots, k;
+    oprun_t *run, *last_run = pk->runs + pk->num_runs;
+    int i;
+
+    null_init();
+
+    for (run = pk->runs;  run < last_run;  run++)
+        switch (run->type) {
+
+        case ALLOC: /* null_malloc */
+	    for (i = run->start;  i < run->end;  i++)
+		if ((blocks[slots[i]] = null_malloc(PK_SIZE(words[i]))) == NULL)
+		    app_error("null_malloc error in eval_null_speed");
+            break;
+
+        case CALLOC: /* null_calloc */
+	    for (i = run->start;  i < run->end;  i++)
+		if ((blocks[slots[i]] = null_calloc(1, PK_SIZE(words[i]))) == NULL)
+		    app_error("null_calloc error in eval_null_speed");
+            break;
+
+        case MEMALIGN: /* null_memalign */
+	    for (i = run->start;  i < run->end;  i++)
+		if ((blocks[slots[i]] = null_memalign(pk->args[i],
+						      PK_SIZE(words[i]))) == NULL)
+		    app_error("null_memalign error in eval_null_speed");
+            break;
+
+	case REALLOC: /* null_realloc */
+	    for (i = run->start;  i < run->end;  i++)
+		if ((blocks[slots[i]] = null_realloc(blocks[slots[i]],
+						     PK_SIZE(words[i]))) == NULL)
+		    app_error("null_realloc error in eval_null_speed");
+            break;
+
+        case FREE: /* null_free */
+	    for (i = run->start;  i < run->end;  i++)
+		null_free(blocks[slots[i]]);
+            break;
+
+        case BATCH_ALLOC: /* null_malloc_batch */
+	    for (i = run->start;  i < run->end;  i++) {
+		bslots = pk->batch_slots + slots[i];
+		if (null_malloc_batch(PK_SIZE(words[i]), pk->args[i], ptrs) != pk->args[i])
+		    app_error("null_malloc_batch error in eval_null_speed");
+		for (k = 0; k < pk->args[i]; k++)
+		    blocks[bslots[k]] = ptrs[k];
+	    }
+            break;
+
+        case BATCH_FREE: /* null_free_batch */
+	    for (i = run->start;  i < run->end;  i++) {
+		bslots = pk->batch_slots + slots[i];
+		for (k = 0; k < pk->args[i]; k++)
+		    ptrs[k] = blocks[bslots[k]];
+		null_free_batch(ptrs, pk->args[i]);
+	    }
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_null_speed");
         }
 }
 
@@ -847,6 +2152,23 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    trace->blocks[trace->ops[i].index] = p;
 	    break;
 
+        case CALLOC: /* calloc */
+	    if ((p = calloc(1, trace->ops[i].size)) == NULL) {
+		malloc_error(tracenum, i, "libc calloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
+        case MEMALIGN: /* aligned_alloc */
+	    if ((p = aligned_alloc(trace->ops[i].align,
+				   trace->ops[i].size)) == NULL) {
+		malloc_error(tracenum, i, "libc aligned_alloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[trace->ops[i].index];
@@ -861,6 +2183,20 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    free(trace->blocks[trace->ops[i].index]);
 	    break;
 
+        case BATCH_ALLOC: /* one malloc per block */
+	    if (libc_malloc_batch(trace->ops[i].size, trace->ops[i].count,
+				  (void **)&trace->blocks[trace->ops[i].index]) !=
+		(size_t)trace->ops[i].count) {
+		malloc_error(tracenum, i, "libc malloc failed");
+		unix_error("System message");
+	    }
+	    break;
+
+        case BATCH_FREE: /* one free per block */
+	    libc_free_batch((void **)&trace->blocks[trace->ops[i].index],
+			    trace->ops[i].count);
+	    break;
+
 	default:
 	    app_error("invalid operation type  in eval_libc_valid");
 	}
@@ -872,51 +2208,125 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 /* 
  * eval_libc_speed - This is the function that is used by fcyc() to
  *    measure the running time of the libc malloc package on the set
- *    of traces.
+ *    of traces. Like eval_mm_speed, it replays the packed op stream.
  */
 static void eval_libc_speed(void *ptr)
 {
+    packed_t *pk = ((speed_t *)ptr)->packed;
+    unsigned *words = pk->words;
+    unsigned *slots = pk->slots;
+    char **blocks = pk->slot_ptrs;
+    void **ptrs = pk->batch_ptrs;
+    unsigned *bslots, k;
+    oprun_t *run, *last_run = pk->runs + pk->num_runs;
     int i;
-    int index, size, newsize;
-    char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    if (((speed_t *)ptr)->touch) {
+	replay_touch(pk, &libc_engine);
+	return;
+    }
+
+    for (run = pk->runs;  run < last_run;  run++) {
+        switch (run->type) {
         case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
-	    if ((p = malloc(size)) == NULL)
-		unix_error("malloc failed in eval_libc_speed");
-	    trace->blocks[index] = p;
+	    for (i = run->start;  i < run->end;  i++)
+		if ((blocks[slots[i]] = malloc(PK_SIZE(words[i]))) == NULL)
+		    unix_error("malloc failed in eval_libc_speed");
+	    break;
+
+        case CALLOC: /* calloc */
+	    for (i = run->start;  i < run->end;  i++)
+		if ((blocks[slots[i]] = calloc(1, PK_SIZE(words[i]))) == NULL)
+		    unix_error("calloc failed in eval_libc_speed");
+	    break;
+
+        case MEMALIGN: /* aligned_alloc */
+	    for (i = run->start;  i < run->end;  i++)
+		if ((blocks[slots[i]] = aligned_alloc(pk->args[i],
+						      PK_SIZE(words[i]))) == NULL)
+		    unix_error("aligned_alloc failed in eval_libc_speed");
 	    break;
 
 	case REALLOC: /* realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
-	    oldp = trace->blocks[index];
-	    if ((newp = realloc(oldp, newsize)) == NULL)
-		unix_error("realloc failed in eval_libc_speed\n");
-	    
-	    trace->blocks[index] = newp;
+	    for (i = run->start;  i < run->end;  i++)
+		if ((blocks[slots[i]] = realloc(blocks[slots[i]],
+						PK_SIZE(words[i]))) == NULL)
+		    unix_error("realloc failed in eval_libc_speed\n");
 	    break;
 	    
         case FREE: /* free */
-	    index = trace->ops[i].index;
-	    block = trace->blocks[index];
-	    free(block);
+	    for (i = run->start;  i < run->end;  i++)
+		free(blocks[slots[i]]);
 	    break;
+
+        case BATCH_ALLOC: /* libc_malloc_batch */
+	    for (i = run->start;  i < run->end;  i++) {
+		bslots = pk->batch_slots + slots[i];
+		if (libc_malloc_batch(PK_SIZE(words[i]), pk->args[i], ptrs) != pk->args[i])
+		    unix_error("libc_malloc_batch failed in eval_libc_speed");
+		for (k = 0; k < pk->args[i]; k++)
+		    blocks[bslots[k]] = ptrs[k];
+	    }
+            break;
+
+        case BATCH_FREE: /* libc_free_batch */
+	    for (i = run->start;  i < run->end;  i++) {
+		bslots = pk->batch_slots + slots[i];
+		for (k = 0; k < pk->args[i]; k++)
+		    ptrs[k] = blocks[bslots[k]];
+		libc_free_batch(ptrs, pk->args[i]);
+	    }
+            break;
 	}
     }
 }
 
+/*
+ * libc_malloc_batch - libc has no batch entry points, so a batch is
+ *    replayed as one malloc per block
+ */
+static size_t libc_malloc_batch(size_t size, size_t n, void **out)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	if ((out[i] = malloc(size)) == NULL)
+	    return i;
+    return n;
+}
+
+/*
+ * libc_free_batch - one free per block
+ */
+static void libc_free_batch(void **ptrs, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	free(ptrs[i]);
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
 
 
 /*
- * printresults - prints a performance summary for some malloc package
+ * netkops - throughput in Kops/sec once the harness overhead has been
+ *     taken out of secs, or 0 if the overhead swamps the measurement
+ */
+static double netkops(double ops, double secs, double overhead)
+{
+    return (secs > overhead) ? (ops/1e3)/(secs - overhead) : 0.0;
+}
+
+/*
+ * printresults - prints a performance summary for some malloc package.
+ *     util is the classic utilization against the brk high water mark
+ *     and rss the same against the resident heap pages. The secs and
+ *     Kops columns are gross figures; ovhd is the time the
+ *     same replay takes against the no-op engine and net Kops is the
+ *     throughput with that overhead subtracted.
  */
 static void printresults(int n, stats_t *stats) 
 {
@@ -924,52 +2334,275 @@ static void printresults(int n, stats_t *stats)
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double rss_util = 0;
+    double overhead = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%6s%8s%10s%6s%10s%8s\n", 
+	   "trace", " valid", "util", "rss", "ops", "secs", "Kops", "ovhd",
+	   "netKops");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%5.0f%%%8.0f%10.6f%6.0f%10.6f%8.0f\n", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
+		   stats[i].rss_util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
-		   (stats[i].ops/1e3)/stats[i].secs);
+		   (stats[i].ops/1e3)/stats[i].secs,
+		   stats[i].overhead,
+		   netkops(stats[i].ops, stats[i].secs, stats[i].overhead));
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
+	    rss_util += stats[i].rss_util;
+	    overhead += stats[i].overhead;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%6s%8s%10s%6s%10s%8s\n", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
+		   "-",
+		   "-",
+		   "-",
 		   "-");
 	}
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	printf("%12s%5.0f%%%5.0f%%%8.0f%10.6f%6.0f%10.6f%8.0f\n", 
 	       "Total       ",
 	       (util/n)*100.0,
+	       (rss_util/n)*100.0,
 	       ops, 
 	       secs,
-	       (ops/1e3)/secs);
+	       (ops/1e3)/secs,
+	       overhead,
+	       netkops(ops, secs, overhead));
     }
     else {
-	printf("%12s%6s%8s%10s%6s\n", 
+	printf("%12s%6s%6s%8s%10s%6s%10s%8s\n", 
 	       "Total       ",
 	       "-", 
 	       "-", 
 	       "-", 
+	       "-", 
+	       "-",
+	       "-",
 	       "-");
     }
 
+    if (reps > 1)
+	printnoise(n, stats);
+}
+
+/*
+ * printnoise - prints how much the timings of the traces moved between
+ *     the repetitions requested with -r
+ */
+static void printnoise(int n, stats_t *stats)
+{
+    int i, valid = 0, worst = 0;
+    double sum = 0;
+
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	valid++;
+	sum += stats[i].noise;
+	if (stats[i].noise > stats[worst].noise || !stats[worst].valid)
+	    worst = i;
+    }
+    if (valid > 0)
+	printf("Timing noise over %d runs: mean %.1f%%, worst %.1f%% "
+	       "(trace %d)\n", reps, 100.0*sum/valid,
+	       100.0*stats[worst].noise, worst);
+}
+
+/*
+ * printbreakdown - prints, for each trace, the average cycles per
+ *     request and the number of requests for each op type and size
+ *     bucket, followed by each op type's share of the total cycles
+ */
+static void printbreakdown(int n, stats_t *stats)
+{
+    static char *bucket_names[NBUCKETS] = {
+	"<=16", "<=64", "<=256", "<=1K", "<=4K", "<=16K", ">16K"
+    };
+    static int op_order[NOPTYPES] = {ALLOC, CALLOC, MEMALIGN, FREE, REALLOC,
+				     BATCH_ALLOC, BATCH_FREE};
+    int i, b, t;
+    double count, cycles, total;
+    breakdown_t *bd;
+
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	bd = &stats[i].breakdown;
+
+	printf("\nBreakdown for trace %d (cycles/op and number of ops):\n", i);
+	printf("%6s%18s%18s%18s%18s%18s%18s%18s\n", "size", "malloc",
+	       "calloc", "memalign", "free", "realloc", "malloc-batch",
+	       "free-batch");
+	for (b = 0; b < NBUCKETS; b++) {
+	    printf("%6s", bucket_names[b]);
+	    for (t = 0; t < NOPTYPES; t++) {
+		count = bd->count[op_order[t]][b];
+		if (count > 0)
+		    printf("%10.0f%8.0f", bd->cycles[op_order[t]][b] / count,
+			   count);
+		else
+		    printf("%10s%8s", "-", "-");
+	    }
+	    printf("\n");
+	}
+
+	/* Totals per op type, and each type's share of all cycles */
+	total = 0;
+	for (t = 0; t < NOPTYPES; t++)
+	    for (b = 0; b < NBUCKETS; b++)
+		total += bd->cycles[t][b];
+	printf("%6s", "all");
+	for (t = 0; t < NOPTYPES; t++) {
+	    count = cycles = 0;
+	    for (b = 0; b < NBUCKETS; b++) {
+		count += bd->count[op_order[t]][b];
+		cycles += bd->cycles[op_order[t]][b];
+	    }
+	    if (count > 0)
+		printf("%10.0f%8.0f", cycles / count, count);
+	    else
+		printf("%10s%8s", "-", "-");
+	}
+	printf("\n%6s", "share");
+	for (t = 0; t < NOPTYPES; t++) {
+	    cycles = 0;
+	    for (b = 0; b < NBUCKETS; b++)
+		cycles += bd->cycles[op_order[t]][b];
+	    printf("%17.1f%%", (total > 0) ? 100.0 * cycles / total : 0.0);
+	}
+	printf("\n");
+    }
+}
+
+/*
+ * printfrag - prints the fragmentation analysis of each trace. internal
+ *     is the allocated-block bytes not requested by the trace (headers
+ *     and padding), ext-idx is 1 - largest/total free bytes (0 means all
+ *     free space is in a single block), and the histogram counts the
+ *     free blocks per size bucket. The heap rows include the mem_map
+ *     regions, which the map rows then show on their own.
+ */
+static void printfrag(int n, stats_t *stats)
+{
+    static char *point_names[2] = {"peak", "end"};
+    static char *map_names[2] = {"p-map", "e-map"};
+    static char *bucket_names[NBUCKETS] = {
+	"<=16", "<=64", "<=256", "<=1K", "<=4K", "<=16K", ">16K"
+    };
+    int i, j, b;
+    frag_t *f;
+
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+
+	printf("\nFragmentation for trace %d (bytes):\n", i);
+	printf("%5s%10s%10s%10s%10s%7s%10s%8s\n", "", "heap", "payload",
+	       "internal", "free", "nfree", "largest", "ext-idx");
+	for (j = 0; j < 2; j++) {
+	    f = &stats[i].frag[j];
+	    printf("%5s%10.0f%10.0f%10.0f%10.0f%7.0f%10.0f%8.2f\n",
+		   point_names[j],
+		   f->heap_bytes,
+		   f->payload_bytes,
+		   f->alloc_bytes - f->payload_bytes,
+		   f->free_bytes,
+		   f->free_blocks,
+		   f->largest_free,
+		   (f->free_bytes > 0) ? 
+		   1.0 - f->largest_free / f->free_bytes : 0.0);
+	}
+	for (j = 0; j < 2; j++) {
+	    f = &stats[i].frag[j];
+	    printf("%5s%10.0f%10.0f%10.0f\n", map_names[j],
+		   f->map_bytes,
+		   f->map_payload,
+		   f->map_bytes - f->map_payload);
+	}
+
+	printf("%5s", "free");
+	for (b = 0; b < NBUCKETS; b++)
+	    printf("%7s", bucket_names[b]);
+	printf("\n");
+	for (j = 0; j < 2; j++) {
+	    printf("%5s", point_names[j]);
+	    for (b = 0; b < NBUCKETS; b++)
+		printf("%7.0f", stats[i].frag[j].free_hist[b]);
+	    printf("\n");
+	}
+    }
+}
+
+/*
+ * printcounters - prints the mm.c internal counters gathered during
+ *     the utilization run of each trace (only built with MM_STATS)
+ */
+static void printcounters(int n, stats_t *stats)
+{
+    int i;
+    mm_stats_t *c;
+
+    printf("%5s%9s%8s%8s%8s%8s%10s%6s%9s%8s%8s%9s%8s%9s%7s%7s%9s%6s%9s%9s%9s%8s%8s%8s%8s%7s%8s%8s%8s%8s\n",
+	   "trace", "searches", "visits", "splits", "coal-n", "coal-p",
+	   "ins-scan", "sbrk", "sbrk-KB", "re-inpl", "re-copy", "copy-KB",
+	   "re-remap", "remap-KB", "expand", "purges", "purge-KB", "maps", "map-KB",
+	   "zero-KB", "skip-KB", "aligned", "gap-KB", "b-alloc", "b-free",
+	   "b-runs", "q-free", "q-hit", "q-flush", "p-free");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid) {
+	    printf("%2d%10s\n", i, "-");
+	    continue;
+	}
+	c = &stats[i].counters;
+	printf("%2d%12lu%8.1f%8lu%8lu%8lu%10.1f%6lu%9.0f%8lu%8lu%9.0f%8lu%9.0f%7lu%7lu%9.0f%6lu%9.0f%9.0f%9.0f%8lu%8.0f%8lu%8lu%7lu%8lu%8lu%8lu%8lu\n",
+	       i,
+	       c->searches,
+	       c->searches ? (double)c->search_visits / c->searches : 0.0,
+	       c->splits,
+	       c->coalesce_next,
+	       c->coalesce_prev,
+	       c->inserts ? (double)c->insert_scan / c->inserts : 0.0,
+	       c->heap_grows,
+	       c->heap_grow_bytes / 1e3,
+	       c->realloc_inplace,
+	       c->realloc_copy,
+	       c->realloc_copy_bytes / 1e3,
+	       c->realloc_remap,
+	       c->remapped_bytes / 1e3,
+	       c->expands,
+	       c->purges,
+	       c->purged_bytes / 1e3,
+	       c->maps,
+	       c->mapped_bytes / 1e3,
+	       c->zeroed_bytes / 1e3,
+	       c->zero_skipped_bytes / 1e3,
+	       c->aligned,
+	       c->align_gap_bytes / 1e3,
+	       c->batch_allocs,
+	       c->batch_frees,
+	       c->batch_runs,
+	       c->quick_frees,
+	       c->quick_hits,
+	       c->quick_flushes,
+	       c->pending_frees);
+    }
+    printf("(visits and ins-scan are averages per search and per insert)\n");
 }
 
 /* 
@@ -1004,14 +2637,27 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValbBFPLTAX] [-f <file>] [-t <dir>] "
+	    "[-c <cpu>] [-r <n>] [-m <MB>] [-p <policy>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-A         Compare all placement policies.\n");
+    fprintf(stderr, "\t-b         Break time down by op type and size.\n");
+    fprintf(stderr, "\t-B         Run mm.c's maintenance thread (MM_THREADS).\n");
+    fprintf(stderr, "\t-c <cpu>   Pin the timed runs to core <cpu>.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-F         Analyze heap fragmentation.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Lock the simulated heap into memory.\n");
+    fprintf(stderr, "\t-m <MB>    Maximum size of the simulated heap (below 4 GB).\n");
+    fprintf(stderr, "\t-p <pol>   Placement policy: first, next, best, good[:K].\n");
+    fprintf(stderr, "\t-P         Raise the scheduling priority.\n");
+    fprintf(stderr, "\t-r <n>     Time each trace <n> times, report noise.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T         Write and read every payload when timing.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-X         Check handles, compaction, expansion and arenas.\n");
 }
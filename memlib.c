@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -14,24 +15,82 @@
 #include "memlib.h"
 #include "config.h"
 
+/*
+ * The simulated heap is a range of virtual addresses reserved with
+ * mmap(PROT_NONE) at mem_init. Pages become accessible only when
+ * mem_sbrk moves the brk past them: they are then committed with
+ * mprotect, MEM_COMMIT_CHUNK bytes at a time so that a run of small
+ * sbrks does not issue one system call each. Committed pages cost
+ * physical memory only once they are touched. The size of the
+ * reservation can be set at runtime with mem_set_max_heap.
+ */
+#define MEM_COMMIT_CHUNK (64*1024)
+
+/*
+ * Besides the sbrk heap, the allocator may ask for regions of their own
+ * with mem_map. memlib keeps a record of each live region, so that the
+ * driver can check payloads against them and count them in the
+ * footprint, and so that mem_reset_brk can drop them all.
+ */
+typedef struct mem_region_t {
+    char *addr;                 /* start of the region (page aligned) */
+    size_t len;                 /* length of the region (page multiple) */
+    struct mem_region_t *next;  /* next live region */
+} mem_region_t;
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_commit_brk; /* end of the committed part of the heap */
+static char *mem_dirty_brk;  /* heap bytes above it still read as zero */
+static size_t mem_max_heap = MAX_HEAP; /* size of the reservation */
+static int mem_locked = 0;   /* set by mem_lock */
+static mem_region_t *mem_regions = NULL; /* live mem_map regions */
+static size_t mem_map_bytes = 0; /* bytes in live regions */
+static size_t mem_map_max = 0;   /* high water mark of mem_map_bytes */
+static char *mem_brk_max;        /* high water mark of mem_brk */
+static size_t mem_footprint_max = 0; /* of mem_heapsize() + mem_map_bytes */
+
+/* private functions */
+static int mem_commit(char *new_brk);
+static mem_region_t **mem_find_region(void *addr);
+static size_t mem_page_round(size_t len);
+static size_t mem_resident(char *addr, size_t len);
+static void mem_lock_pages(char *addr, size_t len);
+static void mem_note_footprint(void);
+
+/*
+ * mem_set_max_heap - set the maximum heap size in bytes. Must be called
+ *    before mem_init; it is rounded up to a whole number of pages, and
+ *    down to MAX_HEAP_LIMIT.
+ */
+void mem_set_max_heap(size_t bytes)
+{
+    if (bytes > MAX_HEAP_LIMIT)
+	bytes = MAX_HEAP_LIMIT;
+    mem_max_heap = mem_page_round(bytes);
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* reserve the address range we will use to model the available VM */
+    mem_start_brk = (char *)mmap(NULL, mem_max_heap, PROT_NONE, 
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				 -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error: %s\n", strerror(errno));
 	exit(1);
     }
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_max_addr = mem_start_brk + mem_max_heap;  /* max legal heap address */
+    mem_brk = mem_start_brk;                      /* heap is empty initially */
+    mem_commit_brk = mem_start_brk;               /* nothing committed yet */
+    mem_dirty_brk = mem_start_brk;                /* nothing written yet */
+    mem_brk_max = mem_start_brk;
 }
 
 /* 
@@ -39,7 +98,8 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_reset_brk();
+    munmap(mem_start_brk, mem_max_heap);
 }
 
 /*
@@ -47,27 +107,96 @@ void mem_deinit(void)
  */
 void mem_reset_brk()
 {
+    mem_region_t *r;
+
+    /* The old heap may have been written anywhere below its brk */
+    if (mem_brk > mem_dirty_brk)
+	mem_dirty_brk = mem_brk;
     mem_brk = mem_start_brk;
+    mem_brk_max = mem_start_brk;
+
+    /* Regions left mapped by the previous run go away with the heap */
+    while ((r = mem_regions) != NULL) {
+	munmap(r->addr, r->len);
+	mem_regions = r->next;
+	free(r);
+    }
+    mem_map_bytes = 0;
+    mem_map_max = 0;
+    mem_footprint_max = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
  *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    this model, the heap can only be shrunk with mem_trim.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ( (incr < 0) || (incr > mem_max_addr - mem_brk)) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
+    if (mem_brk + incr > mem_commit_brk && mem_commit(mem_brk + incr) < 0) {
+	fprintf(stderr, "ERROR: mem_sbrk failed. Could not commit memory: %s\n",
+		strerror(errno));
+	return (void *)-1;
+    }
     mem_brk += incr;
+    if (mem_brk > mem_brk_max)
+	mem_brk_max = mem_brk;
+    mem_note_footprint();
     return (void *)old_brk;
 }
 
+/*
+ * mem_trim - shrink the heap by its last len bytes. The whole pages
+ *    above the new brk are dropped, so that they are no longer resident;
+ *    they stay committed and read back as zeroes. Returns 0 on success
+ *    and -1 (with errno set) if the heap is smaller than len bytes.
+ */
+int mem_trim(size_t len)
+{
+    char *lo;
+
+    if (len > mem_heapsize()) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    /* The bytes given back may have been written anywhere below brk */
+    if (mem_brk > mem_dirty_brk)
+	mem_dirty_brk = mem_brk;
+    mem_brk -= len;
+
+    lo = mem_start_brk + mem_page_round(mem_heapsize());
+    if (lo < mem_commit_brk &&
+	madvise(lo, mem_commit_brk - lo, MADV_DONTNEED) == 0 &&
+	mem_dirty_brk > lo)
+	mem_dirty_brk = lo;
+    return 0;
+}
+
+/*
+ * mem_commit - make the heap accessible up to at least new_brk
+ */
+static int mem_commit(char *new_brk)
+{
+    size_t len = (new_brk - mem_commit_brk + MEM_COMMIT_CHUNK - 1) / 
+	MEM_COMMIT_CHUNK * MEM_COMMIT_CHUNK;
+
+    if (len > (size_t)(mem_max_addr - mem_commit_brk))
+	len = mem_max_addr - mem_commit_brk;
+    if (mprotect(mem_commit_brk, len, PROT_READ | PROT_WRITE) < 0)
+	return -1;
+    mem_lock_pages(mem_commit_brk, len);
+    mem_commit_brk += len;
+    return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +221,367 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_heap_hwm - returns the high water mark of mem_heapsize() since the
+ *    last mem_reset_brk, which only differs from it once mem_trim is used
+ */
+size_t mem_heap_hwm()
+{
+    return (size_t)(mem_brk_max - mem_start_brk);
+}
+
+/*
+ * mem_committed - returns the number of bytes of the heap that have
+ *    been committed so far
+ */
+size_t mem_committed()
+{
+    return (size_t)(mem_commit_brk - mem_start_brk);
+}
+
+/*
+ * mem_touched - returns the number of bytes in committed heap pages,
+ *    and in mem_map regions, that are actually resident, i.e. have been
+ *    touched
+ */
+size_t mem_touched()
+{
+    mem_region_t *r;
+    size_t resident = mem_resident(mem_start_brk, mem_committed());
+
+    for (r = mem_regions; r != NULL; r = r->next)
+	resident += mem_resident(r->addr, r->len);
+    return resident;
+}
+
+/*
+ * mem_resident - returns the number of bytes in resident pages within
+ *    the page aligned range [addr, addr+len)
+ */
+static size_t mem_resident(char *addr, size_t len)
+{
+    size_t pagesize = mem_pagesize();
+    size_t npages = len / pagesize;
+    size_t i, resident = 0;
+    unsigned char *vec;
+
+    if (npages == 0)
+	return 0;
+    if ((vec = (unsigned char *)malloc(npages)) == NULL)
+	return 0;
+    if (mincore(addr, npages * pagesize, vec) == 0) {
+	for (i = 0; i < npages; i++)
+	    resident += vec[i] & 1;
+    }
+    free(vec);
+    return resident * pagesize;
+}
+
+/*
+ * mem_map - map a new region of at least len bytes outside the heap.
+ *    The region is page aligned and zero filled. Returns its start
+ *    address, or (void *)-1 if it cannot be mapped.
+ */
+void *mem_map(size_t len)
+{
+    mem_region_t *r;
+    char *addr;
+
+    len = mem_page_round(len);
+    addr = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE, 
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_map failed: %s\n", strerror(errno));
+	return (void *)-1;
+    }
+    mem_lock_pages(addr, len);
+
+    if ((r = (mem_region_t *)malloc(sizeof(mem_region_t))) == NULL) {
+	munmap(addr, len);
+	errno = ENOMEM;
+	return (void *)-1;
+    }
+    r->addr = addr;
+    r->len = len;
+    r->next = mem_regions;
+    mem_regions = r;
+
+    mem_map_bytes += len;
+    if (mem_map_bytes > mem_map_max)
+	mem_map_max = mem_map_bytes;
+    mem_note_footprint();
+    return addr;
+}
+
+/*
+ * mem_unmap - unmap a region returned by mem_map. Returns 0 on success
+ *    and -1 if addr is not the start of a live region.
+ */
+int mem_unmap(void *addr)
+{
+    mem_region_t **rp = mem_find_region(addr);
+    mem_region_t *r;
+
+    if (rp == NULL) {
+	errno = EINVAL;
+	return -1;
+    }
+    r = *rp;
+    munmap(r->addr, r->len);
+    mem_map_bytes -= r->len;
+    *rp = r->next;
+    free(r);
+    return 0;
+}
+
+/*
+ * mem_remap - resize a region returned by mem_map to at least new_len
+ *    bytes. If may_move is set and the region cannot grow where it is,
+ *    its pages are remapped to a new address, without copying them
+ *    unless they are not all one mapping. Returns the (possibly new)
+ *    start of the region, or (void *)-1 on failure, in which case the
+ *    region is left as it was.
+ */
+void *mem_remap(void *addr, size_t new_len, int may_move)
+{
+    mem_region_t **rp = mem_find_region(addr);
+    mem_region_t *r;
+    char *new_addr;
+
+    if (rp == NULL) {
+	errno = EINVAL;
+	return (void *)-1;
+    }
+    r = *rp;
+    new_len = mem_page_round(new_len);
+    new_addr = (char *)mremap(r->addr, r->len, new_len, 
+			      may_move ? MREMAP_MAYMOVE : 0);
+    if (new_addr == MAP_FAILED && may_move && errno == EFAULT) {
+	/* 
+	 * mremap moves only single mappings; a region that had pages
+	 * moved into it by mem_move_pages is several, so copy it instead.
+	 */
+	new_addr = (char *)mmap(NULL, new_len, PROT_READ | PROT_WRITE, 
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (new_addr != MAP_FAILED) {
+	    memcpy(new_addr, r->addr, new_len < r->len ? new_len : r->len);
+	    munmap(r->addr, r->len);
+	    mem_lock_pages(new_addr, new_len);
+	}
+    }
+    if (new_addr == MAP_FAILED)
+	return (void *)-1;
+    if (new_len > r->len)
+	mem_lock_pages(new_addr + r->len, new_len - r->len);
+
+    mem_map_bytes += new_len - r->len;
+    if (mem_map_bytes > mem_map_max)
+	mem_map_max = mem_map_bytes;
+    mem_note_footprint();
+    r->addr = new_addr;
+    r->len = new_len;
+    return new_addr;
+}
+
+/*
+ * mem_move_pages - move the pages of [src, src+len) to [dst, dst+len)
+ *    by remapping them instead of copying their contents. The source
+ *    range reads back as zeroes afterwards. src may lie in the heap or
+ *    in a region, dst must lie in a region; both must be page aligned.
+ *    Returns 0 on success and -1 on failure.
+ */
+int mem_move_pages(void *dst, void *src, size_t len)
+{
+    if (!mem_in_map(dst, len) || 
+	(!mem_in_map(src, len) && 
+	 ((char *)src < mem_start_brk || (char *)src + len > mem_brk))) {
+	errno = EINVAL;
+	return -1;
+    }
+    if (mremap(src, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, dst) == MAP_FAILED)
+	return -1;
+
+    /* Put fresh pages where the moved ones were */
+    if (mmap(src, len, PROT_READ | PROT_WRITE, 
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_move_pages could not refill %p: %s\n",
+		src, strerror(errno));
+	exit(1);
+    }
+    mem_lock_pages(src, len);
+    mem_lock_pages(dst, len);
+    return 0;
+}
+
+/*
+ * mem_in_map - returns true if [addr, addr+len) lies inside one live
+ *    region returned by mem_map
+ */
+int mem_in_map(void *addr, size_t len)
+{
+    mem_region_t *r;
+
+    for (r = mem_regions; r != NULL; r = r->next)
+	if ((char *)addr >= r->addr && (char *)addr + len <= r->addr + r->len)
+	    return 1;
+    return 0;
+}
+
+/*
+ * mem_in_heap - returns true if addr lies in the range reserved for the
+ *    heap. The bounds are fixed from mem_init to mem_deinit, so unlike
+ *    mem_heap_lo/mem_heap_hi this may be called while the brk moves.
+ */
+int mem_in_heap(void *addr)
+{
+    return (char *)addr >= mem_start_brk && (char *)addr < mem_max_addr;
+}
+
+/*
+ * mem_mapsize - returns the number of bytes in live mem_map regions
+ */
+size_t mem_mapsize()
+{
+    return mem_map_bytes;
+}
+
+/*
+ * mem_map_hwm - returns the high water mark of mem_mapsize() since the
+ *    last mem_reset_brk
+ */
+size_t mem_map_hwm()
+{
+    return mem_map_max;
+}
+
+/*
+ * mem_footprint_hwm - returns the high water mark of mem_heapsize() +
+ *    mem_mapsize() since the last mem_reset_brk. The two marks above may
+ *    have been reached at different times, so their sum can be larger.
+ */
+size_t mem_footprint_hwm()
+{
+    return mem_footprint_max;
+}
+
+/*
+ * mem_note_footprint - raise mem_footprint_max to the current footprint
+ */
+static void mem_note_footprint(void)
+{
+    size_t footprint = mem_heapsize() + mem_map_bytes;
+
+    if (footprint > mem_footprint_max)
+	mem_footprint_max = footprint;
+}
+
+/*
+ * mem_find_region - returns the link that points to the record of the
+ *    region starting at addr, or NULL if there is none
+ */
+static mem_region_t **mem_find_region(void *addr)
+{
+    mem_region_t **rp;
+
+    for (rp = &mem_regions; *rp != NULL; rp = &(*rp)->next)
+	if ((*rp)->addr == (char *)addr)
+	    return rp;
+    return NULL;
+}
+
+/*
+ * mem_page_round - round len up to a whole number of pages
+ */
+static size_t mem_page_round(size_t len)
+{
+    size_t pagesize = mem_pagesize();
+
+    return (len + pagesize - 1) / pagesize * pagesize;
+}
+
+/*
+ * mem_discard - drop the contents of every committed heap page, so
+ *    that none of them is resident until it is touched again. The pages
+ *    stay committed and read back as zeroes. Locked pages cannot be
+ *    discarded and stay resident.
+ */
+void mem_discard(void)
+{
+    if (mem_committed() > 0 &&
+	madvise(mem_start_brk, mem_committed(), MADV_DONTNEED) == 0)
+	mem_dirty_brk = mem_start_brk;
+}
+
+/*
+ * mem_clean_lo - lowest heap address from which the heap still reads as
+ *    zero, as far as the earlier heaps are concerned: every heap reset
+ *    with mem_reset_brk leaves its bytes dirty until mem_discard drops
+ *    them. Bytes written since the last reset are the allocator's to
+ *    track.
+ */
+void *mem_clean_lo(void)
+{
+    return (void *)mem_dirty_brk;
+}
+
+/*
+ * mem_purge - give the pages in [addr, addr+len) back to the system.
+ *    addr and len must be page aligned and the range must lie in the
+ *    heap. The pages stay committed and read back as zeroes. Returns 0
+ *    on success and -1 on failure, e.g. if the pages are locked.
+ */
+int mem_purge(void *addr, size_t len)
+{
+    if ((char *)addr < mem_start_brk || (char *)addr + len > mem_brk) {
+	errno = EINVAL;
+	return -1;
+    }
+    return madvise(addr, len, MADV_DONTNEED);
+}
+
+/*
+ * mem_lock - lock the committed heap into memory, and every page
+ *    committed from now on as it is committed, so that page faults and
+ *    swapping do not show up in the timings. The first chunk is
+ *    committed if need be, so that there is always something to try
+ *    locking. Returns 0 on success and -1 (with errno set) on failure,
+ *    in which case nothing is locked.
+ */
+int mem_lock(void)
+{
+    mem_region_t *r;
+    int err;
+
+    if (mem_committed() == 0 && mem_commit(mem_start_brk + 1) < 0)
+	return -1;
+    if (mlock(mem_start_brk, mem_committed()) < 0)
+	return -1;
+    for (r = mem_regions; r != NULL; r = r->next)
+	if (mlock(r->addr, r->len) < 0) {
+	    err = errno;
+	    munlockall();
+	    errno = err;
+	    return -1;
+	}
+    mem_locked = 1;
+    return 0;
+}
+
+/*
+ * mem_lock_pages - lock [addr, addr+len) if the heap is being locked.
+ *    Running into the locked memory limit later on is not an error: the
+ *    heap just stops being locked, with a warning, and the pages locked
+ *    so far stay locked.
+ */
+static void mem_lock_pages(char *addr, size_t len)
+{
+    if (!mem_locked || mlock(addr, len) == 0)
+	return;
+    fprintf(stderr, "WARNING: could not lock %lu more heap bytes, "
+	    "continuing unlocked: %s\n", (unsigned long)len, strerror(errno));
+    mem_locked = 0;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -1,11 +1,29 @@
 #include <unistd.h>
 
+void mem_set_max_heap(size_t bytes);
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+int mem_trim(size_t len);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_heap_hwm(void);
 size_t mem_pagesize(void);
+size_t mem_committed(void);
+size_t mem_touched(void);
+void mem_discard(void);
+void *mem_clean_lo(void);
+int mem_purge(void *addr, size_t len);
+void *mem_map(size_t len);
+int mem_unmap(void *addr);
+void *mem_remap(void *addr, size_t new_len, int may_move);
+int mem_move_pages(void *dst, void *src, size_t len);
+int mem_in_map(void *addr, size_t len);
+int mem_in_heap(void *addr);
+size_t mem_mapsize(void);
+size_t mem_map_hwm(void);
+size_t mem_footprint_hwm(void);
+int mem_lock(void);
 
@@ -15,6 +15,45 @@
 #include <unistd.h>
 #include <string.h>
 
+/*
+ * In the thread-safe build (MM_THREADS, see mm.h) the public entry points
+ * are defined under these names, without locking, and the end of this
+ * file defines the real ones as wrappers that hold heap_lock around them.
+ * Calls between entry points within this file go straight to the
+ * unlocked versions, so the lock is never taken twice.
+ */
+#if MM_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#define mm_init          mm_init_unlocked
+#define mm_malloc        mm_malloc_unlocked
+#define mm_free          mm_free_unlocked
+#define mm_free_sized    mm_free_sized_unlocked
+#define mm_malloc_batch  mm_malloc_batch_unlocked
+#define mm_free_batch    mm_free_batch_unlocked
+#define mm_usable_size   mm_usable_size_unlocked
+#define mm_realloc       mm_realloc_unlocked
+#define mm_try_expand    mm_try_expand_unlocked
+#define mm_calloc        mm_calloc_unlocked
+#define mm_memalign      mm_memalign_unlocked
+#define mm_aligned_alloc mm_aligned_alloc_unlocked
+#define mm_arena_create  mm_arena_create_unlocked
+#define mm_arena_alloc   mm_arena_alloc_unlocked
+#define mm_arena_free    mm_arena_free_unlocked
+#define mm_arena_reset   mm_arena_reset_unlocked
+#define mm_arena_destroy mm_arena_destroy_unlocked
+#define mm_halloc        mm_halloc_unlocked
+#define mm_hlock         mm_hlock_unlocked
+#define mm_hunlock       mm_hunlock_unlocked
+#define mm_hfree         mm_hfree_unlocked
+#define mm_compact       mm_compact_unlocked
+#define mm_get_stats     mm_get_stats_unlocked
+#define mm_get_params    mm_get_params_unlocked
+#define mm_set_params    mm_set_params_unlocked
+#define mm_heap_walk     mm_heap_walk_unlocked
+#endif
+
 #include "mm.h"
 #include "memlib.h"
 
@@ -37,12 +76,145 @@ team_t team = {
 
 #define DEBUG 1
 
+/*
+ * Build with -DMM_CHECK=1 to have mm_free_sized check the size it is
+ * given against the block, and exit if the block is too small
+ */
+#ifndef MM_CHECK
+#define MM_CHECK 0
+#endif
+
+/*
+ * Defaults of the policy knobs of mm_params_t (see mm.h)
+ */
+#ifdef MM_CONFIG
+#include MM_CONFIG
+#endif
+#ifndef MM_INIT_HEAP
+#define MM_INIT_HEAP 256
+#endif
+#ifndef MM_GROW_FACTOR
+#define MM_GROW_FACTOR 2.0
+#endif
+#ifndef MM_SPLIT_MIN
+#define MM_SPLIT_MIN 8
+#endif
+#ifndef MM_FIT
+#define MM_FIT MM_FIT_FIRST
+#endif
+#ifndef MM_FIT_K
+#define MM_FIT_K 8
+#endif
+
+/*
+ * Page purging: every PURGE_INTERVAL calls to mm_malloc and mm_free, the
+ * free list is scanned. A free block of at least PURGE_MIN_BLOCK bytes
+ * that was already free at the previous scan has the whole pages of its
+ * interior handed back to the system with mem_purge. Blocks freed and
+ * reused within one interval never pay for the system call. A block
+ * remembers which of its pages are purged (see purged_block), and the
+ * part of a free block left over by a split or grown by a merge keeps
+ * that range and its age, so that its pages are neither faulted in by
+ * mm_calloc nor purged twice.
+ */
+#define PURGE 1
+#define PURGE_INTERVAL 4096
+#define PURGE_MIN_BLOCK (64*1024)
+
+/*
+ * Requests of at least MAP_THRESHOLD bytes get a region of their own from
+ * mem_map instead of a heap block, so that one huge block neither grows
+ * the heap for good nor fragments it. The usual tag, holding the region
+ * length, sits in the first page of the region, right before the
+ * payload, and the block is told apart from heap blocks by lying outside
+ * the heap. Because such blocks own whole pages, realloc moves them by
+ * remapping pages rather than copying bytes.
+ */
+#define MAP_THRESHOLD (256*1024)
+
+/*
+ * Deferred coalescing: mm_free puts a block of at most QUICK_MAX bytes on
+ * the quick list of its exact length, LIFO, without merging it or
+ * inserting it in the free list, and mm_malloc takes a block of that
+ * length back from there before searching. Quick blocks keep their
+ * ALLOC_BIT, so that nothing merges with them, and carry QUICK_BIT. They
+ * are all coalesced at once when a search of the free list fails or when
+ * more than QUICK_LIMIT of them are waiting.
+ */
+#define QUICK_MAX 256
+#define QUICK_LIMIT 1024
+#define QUICK_LISTS (QUICK_MAX / ALIGNMENT + 1)
+
+/*
+ * While the maintenance thread of the thread-safe build runs, mm_free
+ * only pushes the block on the pending stack, linked through the first
+ * word of its payload. The thread takes the whole stack at once and
+ * frees it with mm_free_batch, PENDING_BATCH blocks at a time, under
+ * heap_lock; when there is nothing to free it naps MAINT_NAP_NS, after
+ * a purge scan of the free list if it freed anything since the last.
+ * An allocation that finds no fit frees the pending blocks itself
+ * before it grows the heap.
+ */
+#define PENDING_BATCH 256
+#define MAINT_NAP_NS (100*1000)
+
+/*
+ * mm_memalign places a block at the first aligned payload address of a
+ * free block that leaves the part in front either empty or big enough
+ * to stay a free block (MIN_BLOCK_SIZE), so that no padding is wasted
+ * inside the allocated block and the gap remains usable.
+ */
+#define MIN_BLOCK_SIZE ALIGN(sizeof(free_block))
+
+/*
+ * Arenas bump-allocate from chunks of at least ARENA_CHUNK bytes, each
+ * an ordinary heap block obtained with mm_malloc. A reset only rewinds
+ * the arena to its first chunk: the chunks stay with the arena and are
+ * bumped through again, in the same order, until it is destroyed.
+ */
+#define ARENA_CHUNK (16*1024)
+
+/*
+ * Handles name blocks that mm_compact may move. A handle indexes
+ * handle_table, whose entry points to the payload of its block; the
+ * block carries HANDLE_BIT in its tag and the handle in the spare word
+ * of its header, after the tag, so that mm_compact can find the entry
+ * from the block. The table is itself an ordinary, pinned heap block of
+ * at least HANDLE_TABLE_MIN entries that doubles when it is full.
+ */
+#define HANDLE_TABLE_MIN 64
+
+/*
+ * Block metadata is 32 bits wide whatever the pointer size: a tag holds
+ * the block length and flags, and the free-list links are offsets from
+ * the start of the heap rather than pointers, so a free block needs 12
+ * bytes of metadata on a 64-bit build as on a 32-bit one. Blocks are
+ * therefore limited to 4 GB, and so is the heap. mem_map regions only
+ * ever hold a tag, never links.
+ */
+typedef unsigned int tag_t;
+typedef unsigned int link_t;
+
 typedef struct free_block {
-    size_t size;
-    size_t *next;
-    size_t *prev;
+    tag_t size;
+    link_t next;
+    link_t prev;
 } free_block;
 
+/*
+ * A free block with PURGED_BIT set also records, after its links, the
+ * range of its pages that are purged. Only whole pages past these
+ * fields are ever in the range, so a block that has one is long enough
+ * to hold them.
+ */
+typedef struct purged_block {
+    tag_t size;
+    link_t next;
+    link_t prev;
+    link_t purged_lo;  /* first purged byte, as an offset from heap_base */
+    link_t purged_hi;  /* end of the purged pages, likewise */
+} purged_block;
+
 /*
 We use an Explicit Free Lists, using Address-ordered policy
 The struct uses the structure described slide 41 of lecture 8
@@ -55,55 +227,337 @@ The struct uses the structure described slide 41 of lecture 8
 /* rounds up to the nearest multiple of ALIGNMENT */
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
 
-#define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
+#define SIZE_T_SIZE (ALIGN(sizeof(tag_t)))
 #define REAL_SIZE_FROM_USER(size) (ALIGN(size + 2*SIZE_T_SIZE))
-#define GET_BLOCK_LENGTH(ptr) (*(size_t *)ptr & -2)
-#define GET_PREV_TAG(ptr) ((size_t *)((char *)ptr - SIZE_T_SIZE))
-#define GET_PREV_BLOCK_LENGTH(ptr) (*(GET_PREV_TAG(ptr)) & -2)
+/* payload bytes a heap block of length len holds: the inverse of the above */
+#define USER_SIZE_FROM_REAL(len) ((len) - 2*SIZE_T_SIZE)
+/*
+ * Block sizes are multiples of 8, so the low bits of a tag hold flags:
+ * whether the block is allocated and, for free blocks, the purge state
+ * or, for allocated ones, whether a handle owns the block.
+ */
+#define ALLOC_BIT 1  /* the block is allocated */
+#define PURGED_BIT 2 /* the free block has a range of purged pages */
+#define HANDLE_BIT 2 /* the allocated block belongs to a handle */
+#define AGED_BIT 4   /* the free block was already free at the last scan */
+#define QUICK_BIT 4  /* the allocated block is on a quick list */
+#define FLAG_BITS 7
+
+#define GET_BLOCK_LENGTH(ptr) (*(tag_t *)ptr & ~(tag_t)FLAG_BITS)
+#define GET_PREV_TAG(ptr) ((tag_t *)((char *)ptr - SIZE_T_SIZE))
 #define NEXT_BLOCK(ptr) ((void *)((char *)ptr + GET_BLOCK_LENGTH(ptr)))
-#define PREV_BLOCK(ptr) ((void *)((char *)ptr - (GET_PREV_BLOCK_LENGTH(ptr))))
+#define MAX_BLOCK_LENGTH ((size_t)(tag_t)~(tag_t)FLAG_BITS)
+#define PAGE_DOWN(addr) ((size_t)(addr) & ~(mem_pagesize() - 1))
+#define PAGE_UP(addr) PAGE_DOWN((size_t)(addr) + mem_pagesize() - 1)
+#define IS_MAPPED(ptr) (!mem_in_heap(ptr))  /* the reservation never moves */
+#define REGION_OF(ptr) ((char *)PAGE_DOWN(GET_PREV_TAG(ptr)))
+#define HANDLE_OF(block) (*(link_t *)((char *)(block) + sizeof(tag_t)))
+#define IS_QUICK(ptr) ((*(tag_t *)(ptr) & (ALLOC_BIT | QUICK_BIT)) == (ALLOC_BIT | QUICK_BIT))
+
+/*
+ * Free-list links: NIL_LINK stands for the end of the list, since
+ * offset 0 is the first block of the heap. A heap block is in the free
+ * list exactly when its ALLOC_BIT is clear, and no two free blocks are
+ * ever side by side. Blocks have no footers: the free block in front of
+ * a block is found through the list, which is in address order.
+ */
+#define NIL_LINK ((link_t)-1)
+#define TO_LINK(p) ((p) == NULL ? NIL_LINK : (link_t)((char *)(p) - heap_base))
+#define FROM_LINK(l) ((l) == NIL_LINK ? NULL : (free_block *)(heap_base + (l)))
+#define NEXT_FREE(b) FROM_LINK(((free_block *)(b))->next)
+#define PREV_FREE(b) FROM_LINK(((free_block *)(b))->prev)
+#define SET_NEXT_FREE(b, p) (((free_block *)(b))->next = TO_LINK(p))
+#define SET_PREV_FREE(b, p) (((free_block *)(b))->prev = TO_LINK(p))
+
+free_block *free_list_root = NULL;
+
+/* The last block of the free list, where blocks past every free one go */
+static free_block *free_list_tail = NULL;
+
+/* mem_heap_lo(), which the links are relative to */
+static char *heap_base = NULL;
+
+static mm_params_t params = {MM_INIT_HEAP, MM_GROW_FACTOR, MM_SPLIT_MIN,
+                              MM_FIT, MM_FIT_K};
+
+/* Where the next MM_FIT_NEXT search starts */
+static free_block *fit_rover = NULL;
+
+/*
+ * Heap bytes at or above zero_lo have been neither handed out nor used
+ * for block metadata since they last read as zero, so they still do;
+ * zero_lo only moves up until the next mm_init. mm_malloc leaves in
+ * [clean_lo, clean_hi) the part of the block it returns that is known
+ * to be zero, which is all mm_calloc has to skip.
+ */
+static char *zero_lo = NULL;
+static char *clean_lo = NULL;
+static char *clean_hi = NULL;
+
+/*
+ * The handle table: entries of free handles are chained from
+ * handle_free through their next field
+ */
+typedef struct {
+    char *ptr;   /* payload of the handle's block, NULL if it is free */
+    int locks;   /* mm_hlock calls not yet undone by mm_hunlock */
+    int next;    /* next free handle, or -1 */
+} handle_entry;
+
+static handle_entry *handle_table = NULL;
+static int handle_count = 0;
+static int handle_free = -1;
+
+/*
+ * The quick lists, by block length / ALIGNMENT, linked through the next
+ * field of the blocks like the free list
+ */
+static free_block *quick[QUICK_LISTS];
+static int quick_count = 0;
+
+#if MM_THREADS
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *pending = NULL;   /* top of the pending stack */
+static int maint_running = 0;  /* mm_free pushes on the pending stack */
+static int maint_pushing = 0;  /* mm_free calls that may be pushing */
+static int maint_stop = 0;     /* tells the maintenance thread to exit */
+static pthread_t maint_thread;
+#endif
+
+/* mm_malloc and mm_free calls since the last purge scan */
+static int purge_clock = 0;
+
+/*
+ * Counters exported through mm_get_stats. STAT_ADD compiles to nothing
+ * unless MM_STATS is set (see mm.h).
+ */
+#if MM_STATS
+static mm_stats_t stats;
+#define STAT_ADD(field, n) (stats.field += (n))
+#else
+#define STAT_ADD(field, n) do {} while (0)
+#endif
 
-size_t *free_list_root = NULL;
+/*
+ * mark_dirty - note that the n bytes at p are about to be written
+ */
+void mark_dirty(void *p, size_t n)
+{
+    if ((char *)p + n > zero_lo)
+        zero_lo = (char *)p + n;
+}
 
 /* 
  * mm_init - initialize the malloc package.
  */
 int mm_init(void)
 {
-    if (mem_heapsize() < 256)
+#if MM_STATS
+    memset(&stats, 0, sizeof(stats));
+#endif
+
+    if (mem_heapsize() < params.init_heap)
     {
-        mem_sbrk(ALIGN(256 - mem_heapsize()));
+        mem_sbrk(ALIGN(params.init_heap - mem_heapsize()));
     }
 
-    free_block *b = (free_block *)mem_heap_lo();
-    b->next = NULL;
-    b->prev = NULL;
+    heap_base = mem_heap_lo();
+    zero_lo = mem_clean_lo();
+
+    free_block *b = (free_block *)heap_base;
+    SET_NEXT_FREE(b, NULL);
+    SET_PREV_FREE(b, NULL);
     b->size = mem_heapsize();
+    mark_dirty(b, sizeof(free_block));
 
-    free_list_root = (size_t *)b;
+    free_list_root = free_list_tail = b;
+    fit_rover = NULL;
+    purge_clock = 0;
+    handle_table = NULL;
+    handle_count = 0;
+    handle_free = -1;
+    memset(quick, 0, sizeof(quick));
+    quick_count = 0;
+#if MM_THREADS
+    // Blocks of the previous heap
+    __atomic_store_n(&pending, NULL, __ATOMIC_RELAXED);
+#endif
 
     if (DEBUG)
-        printf("Setting first block %x to length %d\n", (unsigned int)b, b->size);
+        printf("Setting first block %p to length %u\n", (void *)b, b->size);
+
+    return 0;
+}
+
+/*
+ * mm_get_stats - copy the counters gathered since the last mm_init into
+ *     *st. Returns 0, and zeroes *st, if the counters are compiled out.
+ */
+int mm_get_stats(mm_stats_t *st)
+{
+#if MM_STATS
+    *st = stats;
+    return 1;
+#else
+    memset(st, 0, sizeof(*st));
+    return 0;
+#endif
+}
+
+/*
+ * mm_get_params - copy the current policy knobs into *p
+ */
+void mm_get_params(mm_params_t *p)
+{
+    *p = params;
+}
 
+/*
+ * mm_set_params - set the policy knobs used from the next mm_init on
+ */
+int mm_set_params(const mm_params_t *p)
+{
+    if (p->init_heap < sizeof(free_block) || p->grow_factor < 1.0 ||
+        p->split_min < ALIGNMENT || p->fit < 0 || p->fit >= MM_FIT_POLICIES ||
+        p->fit_k < 1)
+        return -1;
+    params = *p;
     return 0;
 }
 
 int is_allocated(void *p)
 {
-    return *(size_t *)p & 1;
+    return *(tag_t *)p & 1;
+}
+
+/*
+ * remove_from_list - unlink free block b from the free list
+ */
+void remove_from_list(free_block *b)
+{
+    free_block *prev = PREV_FREE(b);
+    free_block *next = NEXT_FREE(b);
+
+    if (prev != NULL)
+        SET_NEXT_FREE(prev, next);
+    else if (free_list_root == b)
+        free_list_root = next;
+    if (next != NULL)
+        SET_PREV_FREE(next, prev);
+    else if (free_list_tail == b)
+        free_list_tail = prev;
+    if (fit_rover == b)
+        fit_rover = next;
+}
+
+/*
+ * replace_in_list - put free block r in the place of free block b in
+ *     the free list
+ */
+void replace_in_list(free_block *b, free_block *r)
+{
+    free_block *prev = PREV_FREE(b);
+    free_block *next = NEXT_FREE(b);
+
+    r->next = b->next;
+    r->prev = b->prev;
+    if (prev != NULL)
+        SET_NEXT_FREE(prev, r);
+    else if (free_list_root == b)
+        free_list_root = r;
+    if (next != NULL)
+        SET_PREV_FREE(next, r);
+    else if (free_list_tail == b)
+        free_list_tail = r;
+    if (fit_rover == b)
+        fit_rover = r;
+}
+
+/*
+ * get_purged - set [*lo, *hi) to the purged pages of free block p, or to
+ *     an empty range if it has none
+ */
+void get_purged(void *p, char **lo, char **hi)
+{
+    purged_block *b = (purged_block *)p;
+
+    if (b->size & PURGED_BIT)
+    {
+        *lo = heap_base + b->purged_lo;
+        *hi = heap_base + b->purged_hi;
+    }
+    else
+        *lo = *hi = NULL;
+}
+
+/*
+ * set_purged - record [lo, hi), cut down to the whole pages of free
+ *     block p past its purged_block fields, as the purged pages of p.
+ *     PURGED_BIT is cleared if nothing is left of the range.
+ */
+void set_purged(void *p, char *lo, char *hi)
+{
+    purged_block *b = (purged_block *)p;
+    char *first = (char *)PAGE_UP((char *)p + sizeof(purged_block));
+    char *last = (char *)PAGE_DOWN(NEXT_BLOCK(p));
+
+    if (lo < first)
+        lo = first;
+    if (hi > last)
+        hi = last;
+    if (hi <= lo)
+    {
+        b->size &= ~(tag_t)PURGED_BIT;
+        return;
+    }
+    mark_dirty(&b->purged_lo, 2 * sizeof(link_t));
+    b->purged_lo = (link_t)(lo - heap_base);
+    b->purged_hi = (link_t)(hi - heap_base);
+    b->size |= PURGED_BIT;
+}
+
+/*
+ * merge_free - grow free block p over free block n, which lies right
+ *     after it and is already out of the list. The larger of the two
+ *     purged ranges is kept, the pages of the other are given up, and
+ *     the merged block is as aged as the longer of the two was.
+ */
+void merge_free(void *p, void *n)
+{
+    size_t len_p = GET_BLOCK_LENGTH(p), len_n = GET_BLOCK_LENGTH(n);
+    tag_t aged = (len_n > len_p ? *(tag_t *)n : *(tag_t *)p) & AGED_BIT;
+    char *lo, *hi, *n_lo, *n_hi;
+
+    get_purged(p, &lo, &hi);
+    get_purged(n, &n_lo, &n_hi);
+    if (n_hi - n_lo > hi - lo)
+    {
+        lo = n_lo;
+        hi = n_hi;
+    }
+    *(tag_t *)p = (tag_t)(len_p + len_n) | aged;
+    set_purged(p, lo, hi);
 }
 
+/*
+ * coalesce_next - merge free block p, which is in the free list, with the
+ *     block after it if that one is free too
+ */
 void coalesce_next(void *p)
 {
-    // Coalesce block pointed to by p with next block, if it is free
-    size_t *n = NEXT_BLOCK(p);
-    size_t *end_n = mem_heap_hi();
-    if (!is_allocated(n) && n < end_n)
+    free_block *n = NEXT_BLOCK(p);
+    tag_t *end_n = mem_heap_hi();
+
+    if ((tag_t *)n < end_n && !is_allocated(n))
     {
         if (DEBUG)
-            printf("coalesce merge block %x(%d) with block %x(%d)\n", (unsigned int)p, GET_BLOCK_LENGTH(p), (unsigned int)n, GET_BLOCK_LENGTH(n));
+            printf("coalesce merge block %p(%u) with block %p(%u)\n", p, GET_BLOCK_LENGTH(p), (void *)n, GET_BLOCK_LENGTH(n));
 
-        *(size_t *)p += GET_BLOCK_LENGTH(n);
+        if (fit_rover == n)
+            fit_rover = (free_block *)p;
+        remove_from_list(n);
+        merge_free(p, n);
+        STAT_ADD(coalesce_next, 1);
     }
 }
 
@@ -114,270 +568,1647 @@ void insert_into_list(void *p)
      * 
      * This function only makes one assumption on p: its length is 
      * the right length. It initializes prev and next to the previous
-     * and next free block, if they exists, or to 0 otherwise.
+     * and next free block, if they exists, or to NULL otherwise.
      */
 
     free_block *b = (free_block *)p;
-    size_t *start_n = mem_heap_lo();
-    size_t *end_n = mem_heap_hi();
-    size_t *next_free = NEXT_BLOCK(p);
-    size_t *prev_free = NULL;
+    tag_t *end_n = mem_heap_hi();
+    tag_t *next_free = NEXT_BLOCK(p);
+    free_block *prev_free;
+
+    STAT_ADD(inserts, 1);
 
     // We search for the next free block
-    while (is_allocated(next_free) && next_free < end_n)
+    while (next_free < end_n && is_allocated(next_free))
+    {
         next_free = NEXT_BLOCK(next_free);
+        STAT_ADD(insert_scan, 1);
+    }
 
     // We insert it
     if (next_free < end_n)
     {
-        // Now we know that it is free
-        b->next = next_free;
-        prev_free = ((free_block *)next_free)->prev;
-        ((free_block *)next_free)->prev = p;
+        // Now we know that it is free, and so is in the list
+        SET_NEXT_FREE(b, next_free);
+        prev_free = PREV_FREE(next_free);
+        SET_PREV_FREE(next_free, p);
     }
     else
     {
         // b is at the end of the list
-        b->next = NULL;
-
-        // We search for the previous free block
-        prev_free = PREV_BLOCK(p);
-        while (is_allocated(prev_free) && prev_free >= start_n)
-            prev_free = PREV_BLOCK(prev_free);
+        SET_NEXT_FREE(b, NULL);
+        prev_free = free_list_tail;
+        free_list_tail = b;
     }
 
-    if (prev_free >= start_n)
-    {
-        b->prev = prev_free;
-        ((free_block *)prev_free)->next = p;
-    }
+    SET_PREV_FREE(b, prev_free);
+    if (prev_free != NULL)
+        SET_NEXT_FREE(prev_free, p);
     else
-    {
-        // b is at the start of the list
-        b->prev = NULL;
-        free_list_root = (size_t *)b;
-    }
+        free_list_root = b;
 }
 
+/*
+ * coalesce_prev - merge free block p, which is in the free list, into
+ *     the block before it if that one is free too
+ */
 void coalesce_prev(void *p)
 {
-    size_t *previous = PREV_BLOCK(p);
-    
-    // previous can be equal to p if p is mem_heap_lo, in this case we don't do anything
-    if (previous != p && !is_allocated(previous))
+    free_block *previous = PREV_FREE(p);
+
+    if (previous != NULL && NEXT_BLOCK(previous) == p)
     {
         if (DEBUG)
-            printf("coalesce set size for block %x to %d\n", (unsigned int)previous, GET_BLOCK_LENGTH(p) + GET_BLOCK_LENGTH(previous));
-        *(size_t *)previous += GET_BLOCK_LENGTH(p);
+            printf("coalesce set size for block %p to %u\n", (void *)previous, GET_BLOCK_LENGTH(p) + GET_BLOCK_LENGTH(previous));
+        if (fit_rover == (free_block *)p)
+            fit_rover = previous;
+        remove_from_list(p);
+        merge_free(previous, p);
+        STAT_ADD(coalesce_prev, 1);
     }
 }
 
+/*
+ * coalesce - put free block p in the free list, merged with the free
+ *     blocks on either side of it
+ */
 void coalesce(void *p)
 {
+    insert_into_list(p);
     coalesce_next(p);
     coalesce_prev(p);
-    insert_into_list(p);
 }
 
-void increase_heap_size(size_t size)
+/*
+ * increase_heap_size - add a free block of size bytes at the end of the
+ *     heap. Returns -1 if the heap cannot grow that much.
+ */
+int increase_heap_size(size_t size)
 {
     size = ALIGN(size);
     if (DEBUG)
-        printf("Increasing heapsize to %d\n", size);
+        printf("Increasing heapsize to %lu\n", (unsigned long)size);
 
     // Increase
-    size_t *p = mem_sbrk(size);
+    tag_t *p = mem_sbrk(size);
+    if (p == (void *)-1)
+        return -1;
+    STAT_ADD(heap_grows, 1);
+    STAT_ADD(heap_grow_bytes, size);
+    mark_dirty(p, sizeof(free_block));
     *p = size;
 
     if (DEBUG)
-        printf("Added block at %x(%d)\n", (unsigned int)p, GET_BLOCK_LENGTH(p));
+        printf("Added block at %p(%u)\n", (void *)p, GET_BLOCK_LENGTH(p));
 
     coalesce(p);
+    return 0;
+}
+
+size_t flush_pending(void);
+
+/*
+ * flush_quick - coalesce every block of the quick lists into the free list
+ */
+void flush_quick(void)
+{
+    free_block *b, *next;
+    int c;
+
+    STAT_ADD(quick_flushes, 1);
+    STAT_ADD(quick_flushed, quick_count);
+    for (c = 0; c < QUICK_LISTS; c++)
+    {
+        for (b = quick[c]; b != NULL; b = next)
+        {
+            next = NEXT_FREE(b);
+            b->size = GET_BLOCK_LENGTH(b);
+            coalesce(b);
+        }
+        quick[c] = NULL;
+    }
+    quick_count = 0;
 }
 
 void display_memory()
 {
-    size_t *p = mem_heap_lo();
-    size_t *end_p = mem_heap_hi();
+    tag_t *p = mem_heap_lo();
+    tag_t *end_p = mem_heap_hi();
 
     printf("\n************************\n**** DISPLAY MEMORY ****\n");
 
-    printf("Low at: %x, high at %x, length is %d\n", (unsigned int)p, (unsigned int)end_p, mem_heapsize());
+    printf("Low at: %p, high at %p, length is %lu\n", (void *)p, (void *)end_p, (unsigned long)mem_heapsize());
 
     for (; p < end_p; p = NEXT_BLOCK(p))
     {
         if (GET_BLOCK_LENGTH(p) == 0) {
-            fprintf(stderr, "Empy block found at %x, stopping display\n", (unsigned int)p);
+            fprintf(stderr, "Empy block found at %p, stopping display\n", (void *)p);
             break;
         }
         if (is_allocated(p))
-            printf("Block at %x:     allocated of size %d\n",(unsigned int) p, GET_BLOCK_LENGTH(p));
+            printf("Block at %p:     allocated of size %u\n", (void *)p, GET_BLOCK_LENGTH(p));
         else {
-            free_block *b = (free_block *)p;
-            printf("Block at %x: not allocated of size %d --> next=%x, prev=%x\n", (unsigned int)p, GET_BLOCK_LENGTH(p), (unsigned int)b->next, (unsigned int)b->prev);
+            printf("Block at %p: not allocated of size %u --> next=%p, prev=%p\n", (void *)p, GET_BLOCK_LENGTH(p), (void *)NEXT_FREE(p), (void *)PREV_FREE(p));
         }
     }
     printf("************************\n\n");
 }
 
-/* 
- * mm_malloc - Allocate a block by incrementing the brk pointer.
- *     Always allocate a block whose size is a multiple of the alignment.
+/*
+ * mm_heap_walk - call fn on every block of the heap, in address order
  */
-void *mm_malloc(size_t user_size)
+void mm_heap_walk(mm_walk_fn fn, void *arg)
 {
-    size_t newsize = REAL_SIZE_FROM_USER(user_size);
-    size_t tag = newsize | 1; // the block is allocated
-
-    if (DEBUG)
-    {
-        display_memory();
-        printf("User want to malloc %d...\n", user_size);
-    }
+    tag_t *p = mem_heap_lo();
+    tag_t *end_p = mem_heap_hi();
 
-    free_block *p;
-    size_t *end_p = mem_heap_hi();
-    for (p = free_list_root;
-         (p < end_p) && (GET_BLOCK_LENGTH(p) <= newsize);
-         p = p->next)
+    for (; p < end_p; p = NEXT_BLOCK(p))
     {
-        if (DEBUG)
-            printf("Seeing block %x with length %d (allocated: %d)\n", (unsigned int)p, GET_BLOCK_LENGTH(p), is_allocated(p));
         if (GET_BLOCK_LENGTH(p) == 0) {
-            fprintf(stderr, "Empy block found at %x, exiting\n", (unsigned int)p);
-            display_memory();
-            fprintf(stderr, "Empy block found at %x, exiting\n", (unsigned int)p);
-            exit(1);
+            fprintf(stderr, "Empty block found at %p, stopping walk\n", (void *)p);
+            break;
         }
-        
-        if (p->next == NULL)
-            break; // goto next block (word addressed)
-    }
-
-    if (newsize > GET_BLOCK_LENGTH(p) || p >= end_p)
-    {
-        increase_heap_size(2 * newsize);
-        return mm_malloc(user_size);
+        fn(p, GET_BLOCK_LENGTH(p), is_allocated(p) && !IS_QUICK(p), arg);
     }
+}
 
-    if (p == (void *)-1)
-        return NULL;
-    else
-    {
-        size_t old_size = GET_BLOCK_LENGTH(p);
-        *(size_t *)p = tag;
-
-        if (old_size != newsize)
-        {
-            size_t *next_p = NEXT_BLOCK(p);
-            // Set size to the rest of the block, and leave it unallocated
-            *(size_t *)next_p = ALIGN(old_size - newsize);
-        }
+/*
+ * purge_pages - hand the pages [lo, hi) of free block p back to the
+ *     system. Returns -1 if they could not be purged (e.g. they are
+ *     locked).
+ */
+int purge_pages(void *p, char *lo, char *hi)
+{
+    if (hi <= lo)
+        return 0;
+    if (mem_purge(lo, hi - lo) < 0)
+        return -1;
+    STAT_ADD(purges, 1);
+    STAT_ADD(purged_bytes, hi - lo);
+    if (DEBUG)
+        printf("Purged %lu bytes inside block %p\n", (unsigned long)(hi - lo), p);
+    return 0;
+}
 
-        if (DEBUG)
-            printf("Malloc %d to %x\n\n", user_size, (unsigned int)p);
+/*
+ * purge_block - hand the whole pages inside free block p that are not
+ *     purged yet back to the system, leaving its tag and list links in
+ *     place. The block only records them as purged once they read as
+ *     zero; if they could not be purged it is tried again next scan.
+ */
+void purge_block(void *p)
+{
+    char *lo = (char *)PAGE_UP((char *)p + sizeof(purged_block));
+    char *hi = (char *)PAGE_DOWN(NEXT_BLOCK(p));
+    char *done_lo, *done_hi;
 
-        return (void *)((char *)p + SIZE_T_SIZE);
-    }
+    get_purged(p, &done_lo, &done_hi);
+    if (done_hi <= done_lo)
+        done_lo = done_hi = hi;
+    if (purge_pages(p, lo, done_lo) < 0 || purge_pages(p, done_hi, hi) < 0)
+        return;
+    set_purged(p, lo, hi);
 }
 
 /*
- * mm_free - 
+ * fully_purged - whether every page purge_block would purge in free
+ *     block p already is
  */
-void mm_free(void *ptr)
+int fully_purged(void *p)
 {
-    if (DEBUG)
-        display_memory();
+    char *lo, *hi;
 
-    size_t *p = GET_PREV_TAG(ptr);
-    *p = *p & -2;
+    get_purged(p, &lo, &hi);
+    return lo == (char *)PAGE_UP((char *)p + sizeof(purged_block)) &&
+           hi == (char *)PAGE_DOWN(NEXT_BLOCK(p));
+}
 
-    int len_p = GET_BLOCK_LENGTH(p);
+void purge_scan(void);
 
-    coalesce(p);
+/*
+ * purge_tick - count one call to mm_malloc or mm_free and, every
+ *     PURGE_INTERVAL calls, purge the large free blocks that have stayed
+ *     free since the previous scan
+ */
+void purge_tick(void)
+{
+    if (!PURGE || ++purge_clock < PURGE_INTERVAL)
+        return;
+    purge_clock = 0;
+    purge_scan();
+}
 
-    if (DEBUG)
+/*
+ * purge_scan - purge the large free blocks that were already free at
+ *     the previous scan, and mark the others as now seen free. Allocated
+ *     blocks are skipped: their bits 2 and 4 mean something else.
+ */
+void purge_scan(void)
+{
+    free_block *p;
+    tag_t *end_p;
+
+    end_p = mem_heap_hi();
+    for (p = free_list_root; p != NULL && (tag_t *)p < end_p; p = NEXT_FREE(p))
     {
-        printf("Freeing %d at %x. The result:\n", len_p, (unsigned int)p);
-        display_memory();
+        if (is_allocated(p) || GET_BLOCK_LENGTH(p) < PURGE_MIN_BLOCK ||
+            fully_purged(p))
+            continue;
+        if (p->size & AGED_BIT)
+            purge_block(p);
+        else
+            p->size |= AGED_BIT;
     }
 }
 
 /*
- * mm_realloc - realloc using implicit simply linked list.
- * Use the free space at old pointer if possible, else do a new malloc/copy/free
- * u_* variables denote things that are as seen by the user:
- *    sizes are payload sizes
- *    pointer are pyload start pointers
- * variables with no 'u_' prefix denote things that are as they are in memory:
- *    sizes are actual block sizes
- *    pointers are block start pointers
- * *_p variables are pointers to blocks
- * *_size variables are size variables
+ * map_block - allocate a block in a region of its own, placing the
+ * payload at the given offset within a page. Returns the payload.
  */
-void *mm_realloc(void *ptr, size_t size)
+void *map_block(size_t user_size, size_t page_off)
 {
+    size_t page = mem_pagesize();
+    size_t tag_off = (page_off >= SIZE_T_SIZE ? page_off : page_off + page) - SIZE_T_SIZE;
+    size_t len = PAGE_UP(tag_off + SIZE_T_SIZE + user_size);
+    char *region;
 
-    if (DEBUG)
-        display_memory();
-
-    size_t u_new_size = size;
-    size_t new_size = REAL_SIZE_FROM_USER(size);
-    void *u_old_p = ptr;
-    void *old_p = GET_PREV_TAG(ptr);
-    size_t old_size = GET_BLOCK_LENGTH(old_p);
+    // The length must fit in the tag
+    if (user_size > MAX_BLOCK_LENGTH || len > MAX_BLOCK_LENGTH)
+        return NULL;
+    if ((region = mem_map(len)) == (void *)-1)
+        return NULL;
+    *(tag_t *)(region + tag_off) = len | 1;
+    STAT_ADD(maps, 1);
+    STAT_ADD(mapped_bytes, len);
 
     if (DEBUG)
-        printf("User want to realloc %x(%d) to size %d\n", (unsigned int)old_p, old_size, new_size);
+        printf("Mapped %lu bytes at %p for malloc %lu\n", (unsigned long)len, region, (unsigned long)user_size);
 
-    if (old_size == new_size)
-        return ptr;
-    if (old_size == 0)
-        return mm_malloc(size);
+    return region + tag_off + SIZE_T_SIZE;
+}
 
-    // If there is enough space in the old block, just create a new free block after it
-    if (old_size >= new_size) {
-        if (DEBUG)  
-            printf("The old block is large enough\n");
+/*
+ * move_to_map - move the payload of heap block ptr, of which the first
+ * copy_size bytes are live, to a new region of its own big enough for
+ * user_size bytes. The new payload has the same offset within a page as
+ * the old one, so the whole pages in the middle are moved by remapping
+ * them with mem_move_pages; only the head and tail bytes are copied.
+ */
+void *move_to_map(void *ptr, size_t copy_size, size_t user_size)
+{
+    char *new_ptr = map_block(user_size, (size_t)ptr & (mem_pagesize() - 1));
+    char *lo = (char *)PAGE_UP(ptr);
+    char *hi = (char *)PAGE_DOWN((char *)ptr + copy_size);
 
-        // Set the old block (it is allocated)
-        *(size_t *)old_p = new_size | 1;
+    if (new_ptr == NULL)
+        return NULL;
 
-        // 'newnext' variables correspond to the free block which has just been created
-        void *newnext_p = NEXT_BLOCK(old_p);
-        size_t newnext_size = old_size - new_size;
-        // The 'allocated' bit is purposefully not set
-        *(size_t *)newnext_p = newnext_size;
-        coalesce_next(newnext_p);
-        return u_old_p;
+    if (hi > lo && mem_move_pages(new_ptr + (lo - (char *)ptr), lo, hi - lo) == 0)
+    {
+        memcpy(new_ptr, ptr, lo - (char *)ptr);
+        memcpy(new_ptr + (hi - (char *)ptr), hi, (char *)ptr + copy_size - hi);
+        STAT_ADD(realloc_remap, 1);
+        STAT_ADD(remapped_bytes, hi - lo);
+        STAT_ADD(realloc_copy_bytes, copy_size - (hi - lo));
+    }
+    else
+    {
+        memcpy(new_ptr, ptr, copy_size);
+        STAT_ADD(realloc_copy, 1);
+        STAT_ADD(realloc_copy_bytes, copy_size);
+    }
+
+    mm_free(ptr);
+    return new_ptr;
+}
+
+/*
+ * remap_block - realloc for a block allocated by map_block. The region
+ * is resized with mem_remap, which moves it by remapping its pages if it
+ * cannot grow where it is, so the payload is never copied unless the
+ * block shrinks below MAP_THRESHOLD and goes back to the heap.
+ */
+void *remap_block(void *ptr, size_t user_size)
+{
+    char *region = REGION_OF(ptr);
+    size_t old_len = GET_BLOCK_LENGTH(GET_PREV_TAG(ptr));
+    size_t payload_off = (char *)ptr - region;
+    size_t len = PAGE_UP(payload_off + user_size);
+    size_t copy_size = old_len - payload_off;
+    char *new_region;
+    void *new_ptr;
+
+    if (user_size >= MAP_THRESHOLD)
+    {
+        if (user_size > MAX_BLOCK_LENGTH || len > MAX_BLOCK_LENGTH)
+            return NULL;
+        if (len == old_len)
+            new_region = region;
+        else if ((new_region = mem_remap(region, len, 1)) == (void *)-1)
+            return NULL;
+        new_ptr = new_region + payload_off;
+        *GET_PREV_TAG(new_ptr) = len | 1;
+        if (new_region == region)
+            STAT_ADD(realloc_inplace, 1);
+        else
+        {
+            STAT_ADD(realloc_remap, 1);
+            STAT_ADD(remapped_bytes, len < old_len ? len : old_len);
+        }
+        return new_ptr;
+    }
+
+    if ((new_ptr = mm_malloc(user_size)) == NULL)
+        return NULL;
+    if (copy_size > user_size)
+        copy_size = user_size;
+    memcpy(new_ptr, ptr, copy_size);
+    STAT_ADD(realloc_copy, 1);
+    STAT_ADD(realloc_copy_bytes, copy_size);
+    mem_unmap(region);
+
+    return new_ptr;
+}
+
+/*
+ * find_fit - search the free list, from start up to stop, for a free
+ *     block of at least newsize bytes, following params.fit. Returns
+ *     NULL if none fits.
+ */
+free_block *find_fit(free_block *start, free_block *stop, size_t newsize)
+{
+    free_block *p, *best = NULL;
+    tag_t *end_p = mem_heap_hi();
+    size_t len;
+    int candidates = 0;
+
+    for (p = start; p != NULL && p != stop && (tag_t *)p < end_p; p = NEXT_FREE(p))
+    {
+        STAT_ADD(search_visits, 1);
+        len = GET_BLOCK_LENGTH(p);
+        if (DEBUG)
+            printf("Seeing block %p with length %lu (allocated: %d)\n", (void *)p, (unsigned long)len, is_allocated(p));
+        if (len == 0) {
+            fprintf(stderr, "Empy block found at %p, exiting\n", (void *)p);
+            display_memory();
+            fprintf(stderr, "Empy block found at %p, exiting\n", (void *)p);
+            exit(1);
+        }
+        if (is_allocated(p) || len < newsize)
+            continue;
+
+        // First and next fit take the first block that fits
+        if (params.fit == MM_FIT_FIRST || params.fit == MM_FIT_NEXT)
+            return p;
+
+        // Best and good fit keep the tightest, and stop early on an exact fit
+        if (best == NULL || len < GET_BLOCK_LENGTH(best))
+            best = p;
+        if (len == newsize)
+            break;
+        if (params.fit == MM_FIT_GOOD && ++candidates >= params.fit_k)
+            break;
+    }
+    return best;
+}
+
+/*
+ * set_clean - set [clean_lo, clean_hi) to the part of block p, just
+ *     carved from a free block whose purged pages were [purged_lo,
+ *     purged_hi), that is known to be zero: the bytes above zero_lo and
+ *     those pages. The free block's own header is never clean. When the
+ *     two ranges are apart, the larger one is kept.
+ */
+void set_clean(void *p, char *purged_lo, char *purged_hi)
+{
+    char *lo = (char *)p + sizeof(free_block);
+    char *end = (char *)NEXT_BLOCK(p);
+
+    clean_lo = zero_lo > lo ? zero_lo : lo;
+    clean_hi = end;
+    if (purged_hi > end)
+        purged_hi = end;
+    if (purged_hi <= purged_lo)
+        return;
+
+    if (purged_hi >= clean_lo)
+    {
+        if (purged_lo < clean_lo)
+            clean_lo = purged_lo;
+    }
+    else if (purged_hi - purged_lo > end - clean_lo)
+    {
+        clean_lo = purged_lo;
+        clean_hi = purged_hi;
+    }
+}
+
+/* 
+ * mm_malloc - Allocate a block by incrementing the brk pointer.
+ *     Always allocate a block whose size is a multiple of the alignment.
+ */
+void *mm_malloc(size_t user_size)
+{
+    size_t newsize = REAL_SIZE_FROM_USER(user_size);
+    size_t tag = newsize | 1; // the block is allocated
+
+    if (user_size >= MAP_THRESHOLD)
+        return map_block(user_size, SIZE_T_SIZE);
+
+    if (DEBUG)
+    {
+        display_memory();
+        printf("User want to malloc %lu...\n", (unsigned long)user_size);
+    }
+
+    free_block *p;
+    if (newsize <= QUICK_MAX && (p = quick[newsize / ALIGNMENT]) != NULL)
+    {
+        // A block of this very length freed lately: no search, no split
+        quick[newsize / ALIGNMENT] = NEXT_FREE(p);
+        quick_count--;
+        p->size = tag;
+        clean_lo = clean_hi = NULL;
+        STAT_ADD(quick_hits, 1);
+        purge_tick();
+        return (char *)p + SIZE_T_SIZE;
+    }
+
+    STAT_ADD(searches, 1);
+    if (params.fit == MM_FIT_NEXT && fit_rover != NULL)
+    {
+        // Search from the rover to the end of the list, then wrap around
+        p = find_fit(fit_rover, NULL, newsize);
+        if (p == NULL)
+            p = find_fit(free_list_root, fit_rover, newsize);
+    }
+    else
+        p = find_fit(free_list_root, NULL, newsize);
+
+    if (p == NULL)
+    {
+        if (quick_count > 0)
+            flush_quick();
+        else if (flush_pending() == 0 &&
+                 increase_heap_size((size_t)(params.grow_factor * newsize)) < 0)
+            return NULL;
+        return mm_malloc(user_size);
+    }
+
+    if (p == (void *)-1)
+        return NULL;
+    else
+    {
+        size_t old_size = GET_BLOCK_LENGTH(p);
+        tag_t aged = *(tag_t *)p & AGED_BIT;
+        char *purged_lo, *purged_hi;
+
+        get_purged(p, &purged_lo, &purged_hi);
+
+        // A remainder too small to be worth a free block stays with the allocated one
+        if (old_size - newsize < params.split_min || old_size - newsize < MIN_BLOCK_SIZE)
+        {
+            tag = old_size | 1;
+            fit_rover = NEXT_FREE(p);
+            remove_from_list(p);
+        }
+        else
+        {
+            free_block *next_p = (free_block *)((char *)p + newsize);
+            // Set size to the rest of the block, and leave it unallocated
+            // in the place of p in the free list. It keeps its age, and
+            // those of its pages that were purged.
+            next_p->size = ALIGN(old_size - newsize) | aged;
+            replace_in_list(p, next_p);
+            fit_rover = next_p;
+            STAT_ADD(splits, 1);
+        }
+        *(tag_t *)p = tag;
+
+        // Note what is still zero, then count the block and the header after it as written
+        set_clean(p, purged_lo, purged_hi);
+        mark_dirty(p, GET_BLOCK_LENGTH(p) + sizeof(free_block));
+        if (GET_BLOCK_LENGTH(p) < old_size)
+            set_purged(NEXT_BLOCK(p), purged_lo, purged_hi);
+
+        if (DEBUG)
+            printf("Malloc %lu to %p\n\n", (unsigned long)user_size, (void *)p);
+
+        purge_tick();
+
+        return (void *)((char *)p + SIZE_T_SIZE);
+    }
+}
+
+/*
+ * mm_free - 
+ */
+void mm_free(void *ptr)
+{
+    if (IS_MAPPED(ptr))
+    {
+        mem_unmap(REGION_OF(ptr));
+        return;
+    }
+
+    if (DEBUG)
+        display_memory();
+
+    tag_t *p = GET_PREV_TAG(ptr);
+    int len_p = GET_BLOCK_LENGTH(p);
+
+    // Defer the merge of a small block; it is likely to be asked for again
+    if (len_p <= QUICK_MAX)
+    {
+        *p = len_p | ALLOC_BIT | QUICK_BIT;
+        SET_NEXT_FREE(p, quick[len_p / ALIGNMENT]);
+        quick[len_p / ALIGNMENT] = (free_block *)p;
+        STAT_ADD(quick_frees, 1);
+        if (++quick_count > QUICK_LIMIT)
+            flush_quick();
+        purge_tick();
+        return;
+    }
+
+    *p = len_p;
+
+    coalesce(p);
+    purge_tick();
+
+    if (DEBUG)
+    {
+        printf("Freeing %d at %p. The result:\n", len_p, (void *)p);
+        display_memory();
+    }
+}
+
+/*
+ * mm_calloc - allocate a zeroed array of nmemb elements of size bytes.
+ *     Only the part of the block that mm_malloc did not find to be zero
+ *     already (fresh heap, purged pages, a region of its own) is cleared.
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    size_t user_size;
+    char *ptr, *end, *lo, *hi;
+
+    // The product must not wrap around
+    if (size != 0 && nmemb > (size_t)-1 / size)
+        return NULL;
+    user_size = nmemb * size;
+
+    if ((ptr = mm_malloc(user_size)) == NULL)
+        return NULL;
+    end = ptr + user_size;
+
+    // A region of its own is fresh from mmap
+    if (IS_MAPPED(ptr))
+    {
+        STAT_ADD(zero_skipped_bytes, user_size);
+        return ptr;
+    }
+
+    lo = clean_lo < ptr ? ptr : (clean_lo > end ? end : clean_lo);
+    hi = clean_hi > end ? end : (clean_hi < lo ? lo : clean_hi);
+    memset(ptr, 0, lo - ptr);
+    memset(hi, 0, end - hi);
+    STAT_ADD(zeroed_bytes, user_size - (hi - lo));
+    STAT_ADD(zero_skipped_bytes, hi - lo);
+
+    return ptr;
+}
+
+/*
+ * align_payload - the first payload address in free block p that is a
+ *     multiple of alignment and leaves in front of it either nothing or
+ *     a free block of at least MIN_BLOCK_SIZE bytes
+ */
+char *align_payload(void *p, size_t alignment)
+{
+    size_t u = (size_t)p + SIZE_T_SIZE;
+    size_t a = (u + alignment - 1) & ~(alignment - 1);
+
+    if (a != u && a - u < MIN_BLOCK_SIZE)
+        a += alignment;
+    return (char *)a;
+}
+
+/*
+ * find_aligned_fit - search the free list for a block that holds newsize
+ *     bytes at an aligned payload address, which is stored in *payload.
+ *     Aligned requests always take the first fit, so that their gaps
+ *     stay at the low end of the heap with the other free blocks.
+ */
+free_block *find_aligned_fit(size_t newsize, size_t alignment, char **payload)
+{
+    free_block *p;
+    tag_t *end_p = mem_heap_hi();
+    char *u;
+
+    for (p = free_list_root; p != NULL && (tag_t *)p < end_p; p = NEXT_FREE(p))
+    {
+        STAT_ADD(search_visits, 1);
+        if (is_allocated(p))
+            continue;
+        u = align_payload(p, alignment);
+        if (u - SIZE_T_SIZE + newsize <= (char *)p + GET_BLOCK_LENGTH(p))
+        {
+            *payload = u;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * mm_memalign - allocate a block whose payload address is a multiple of
+ *     alignment, a power of two. The gap in front of the block stays a
+ *     free block where it is in the free list, and the tail goes back
+ *     to the list if it is worth a block of its own.
+ */
+void *mm_memalign(size_t alignment, size_t user_size)
+{
+    size_t newsize = REAL_SIZE_FROM_USER(user_size);
+    size_t page = mem_pagesize();
+    size_t rest;
+    tag_t aged;
+    free_block *p;
+    char *u, *q, *end, *purged_lo, *purged_hi;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        return NULL;
+    if (alignment <= ALIGNMENT)
+        return mm_malloc(user_size);
+    // Regions are page aligned, so any offset within a page can be had
+    if (user_size >= MAP_THRESHOLD && alignment <= page)
+        return map_block(user_size, alignment & (page - 1));
+
+    STAT_ADD(searches, 1);
+    while ((p = find_aligned_fit(newsize, alignment, &u)) == NULL)
+    {
+        if (quick_count > 0)
+            flush_quick();
+        else if (flush_pending() == 0 &&
+                 increase_heap_size((size_t)(params.grow_factor * (newsize + alignment + MIN_BLOCK_SIZE))) < 0)
+            return NULL;
+    }
+
+    q = u - SIZE_T_SIZE;
+    end = (char *)p + GET_BLOCK_LENGTH(p);
+    aged = p->size & AGED_BIT;
+    get_purged(p, &purged_lo, &purged_hi);
+    mark_dirty(q, newsize + sizeof(free_block));
+
+    if (q > (char *)p)
+    {
+        // Shorten the free block to the gap, leaving its links alone
+        p->size = (tag_t)(q - (char *)p) | aged;
+        set_purged(p, purged_lo, purged_hi);
+        STAT_ADD(splits, 1);
+        STAT_ADD(align_gap_bytes, q - (char *)p);
+    }
+    else
+        remove_from_list(p);
+
+    rest = end - (q + newsize);
+    if (rest < params.split_min || rest < MIN_BLOCK_SIZE)
+        *(tag_t *)q = (tag_t)(end - q) | 1;
+    else
+    {
+        tag_t *r = (tag_t *)(q + newsize);
+        *(tag_t *)q = newsize | 1;
+        *r = rest | aged;
+        insert_into_list(r);
+        set_purged(r, purged_lo, purged_hi);
+        STAT_ADD(splits, 1);
+    }
+    STAT_ADD(aligned, 1);
+
+    if (DEBUG)
+        printf("Memalign %lu (%lu) to %p\n\n", (unsigned long)user_size, (unsigned long)alignment, (void *)q);
+
+    purge_tick();
+
+    return u;
+}
+
+/*
+ * mm_aligned_alloc - C11 aligned_alloc, the same as mm_memalign
+ */
+void *mm_aligned_alloc(size_t alignment, size_t user_size)
+{
+    return mm_memalign(alignment, user_size);
+}
+
+/*
+ * mm_malloc_batch - allocate n blocks of user_size bytes into out[] with
+ *     a single free-list search and a single split: the blocks are
+ *     carved side by side from one free block, whose remainder takes
+ *     its place in the free list. Returns n, or 0 if it failed.
+ */
+size_t mm_malloc_batch(size_t user_size, size_t n, void **out)
+{
+    size_t newsize = REAL_SIZE_FROM_USER(user_size);
+    size_t total, old_size, rest, i;
+    tag_t aged;
+    free_block *p;
+    char *q, *purged_lo, *purged_hi;
+
+    if (n == 0)
+        return 0;
+
+    // Huge blocks get regions of their own, and a run must fit in a tag
+    if (user_size >= MAP_THRESHOLD || n > MAX_BLOCK_LENGTH / newsize)
+    {
+        for (i = 0; i < n; i++)
+        {
+            if ((out[i] = mm_malloc(user_size)) == NULL)
+            {
+                while (i > 0)
+                    mm_free(out[--i]);
+                return 0;
+            }
+        }
+        return n;
+    }
+    total = n * newsize;
+
+    STAT_ADD(searches, 1);
+    while ((p = find_fit(free_list_root, NULL, total)) == NULL)
+    {
+        if (quick_count > 0)
+            flush_quick();
+        else if (flush_pending() == 0 &&
+                 increase_heap_size((size_t)(params.grow_factor * total)) < 0)
+            return 0;
+    }
+
+    old_size = GET_BLOCK_LENGTH(p);
+    aged = p->size & AGED_BIT;
+    get_purged(p, &purged_lo, &purged_hi);
+    rest = old_size - total;
+    if (rest < params.split_min || rest < MIN_BLOCK_SIZE)
+    {
+        // The last block keeps the remainder
+        remove_from_list(p);
+        rest = 0;
+    }
+    else
+    {
+        free_block *r = (free_block *)((char *)p + total);
+        r->size = rest | aged;
+        replace_in_list(p, r);
+        STAT_ADD(splits, 1);
+    }
+    mark_dirty(p, old_size - rest + sizeof(free_block));
+    if (rest > 0)
+        set_purged((char *)p + total, purged_lo, purged_hi);
+
+    for (i = 0, q = (char *)p; i < n; i++, q += newsize)
+    {
+        *(tag_t *)q = newsize | 1;
+        out[i] = q + SIZE_T_SIZE;
+    }
+    if (rest == 0)
+        *(tag_t *)(q - newsize) = (tag_t)(newsize + old_size - total) | 1;
+    STAT_ADD(batch_allocs, n);
+
+    if (DEBUG)
+        printf("Malloc batch of %lu x %lu to %p\n\n", (unsigned long)n, (unsigned long)user_size, (void *)p);
+
+    purge_tick();
+
+    return n;
+}
+
+/*
+ * compare_addr - qsort order of block pointers, by address
+ */
+int compare_addr(const void *a, const void *b)
+{
+    char *x = *(char * const *)a;
+    char *y = *(char * const *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * mm_free_batch - free the n blocks of ptrs[], which is sorted by address
+ *     in place. Blocks lying side by side in the heap are first joined
+ *     into a single free block, so that each run of them is coalesced
+ *     and inserted into the free list once.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    size_t i, j;
+    tag_t *p, *end;
+
+    qsort(ptrs, n, sizeof(void *), compare_addr);
+
+    for (i = 0; i < n; i = j)
+    {
+        j = i + 1;
+        if (ptrs[i] == NULL)
+            continue;
+        if (IS_MAPPED(ptrs[i]))
+        {
+            mem_unmap(REGION_OF(ptrs[i]));
+            continue;
+        }
+
+        p = GET_PREV_TAG(ptrs[i]);
+        end = NEXT_BLOCK(p);
+        while (j < n && ptrs[j] != NULL && GET_PREV_TAG(ptrs[j]) == end)
+        {
+            end = NEXT_BLOCK(end);
+            j++;
+        }
+        *p = (tag_t)((char *)end - (char *)p);
+        coalesce(p);
+        STAT_ADD(batch_runs, 1);
+    }
+    STAT_ADD(batch_frees, n);
+    purge_tick();
+
+    if (DEBUG)
+    {
+        printf("Freed a batch of %lu blocks. The result:\n", (unsigned long)n);
+        display_memory();
+    }
+}
+
+/*
+ * flush_pending - free the blocks on the pending stack. Returns how many
+ *     there were; always 0 unless the maintenance thread is used.
+ */
+size_t flush_pending(void)
+{
+#if MM_THREADS
+    void *buf[PENDING_BATCH];
+    void *b = __atomic_exchange_n(&pending, NULL, __ATOMIC_ACQUIRE);
+    size_t n = 0, total = 0;
+
+    while (b != NULL)
+    {
+        buf[n++] = b;
+        b = *(void **)b;
+        if (n == PENDING_BATCH || b == NULL)
+        {
+            mm_free_batch(buf, n);
+            total += n;
+            n = 0;
+        }
+    }
+    if (total > 0)
+    {
+        STAT_ADD(pending_flushes, 1);
+        STAT_ADD(pending_frees, total);
+    }
+    return total;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * An arena's chunks form a list in the order they are bumped through.
+ * Chunks after cur are untouched since the last reset.
+ */
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;              /* bytes of the chunk after this header */
+} arena_chunk;
+
+struct mm_arena {
+    arena_chunk *first;
+    arena_chunk *cur;         /* the chunk being bumped through, or NULL */
+    char *bump;               /* next free byte of cur */
+    char *end;                /* end of cur */
+    char *last;               /* the last object handed out */
+};
+
+/*
+ * mm_arena_create - make an empty arena. Its first chunk is only taken
+ *     from the heap by the first mm_arena_alloc.
+ */
+mm_arena_t *mm_arena_create(void)
+{
+    mm_arena_t *a = mm_malloc(sizeof(mm_arena_t));
+
+    if (a == NULL)
+        return NULL;
+    a->first = a->cur = NULL;
+    a->bump = a->end = a->last = NULL;
+    return a;
+}
+
+/*
+ * arena_next_chunk - make the cur of arena a the first chunk after it
+ *     with at least size bytes, moving that chunk right after cur, or a
+ *     new one if there is none. Returns -1 if the heap is exhausted.
+ */
+int arena_next_chunk(mm_arena_t *a, size_t size)
+{
+    arena_chunk **link = a->cur != NULL ? &a->cur->next : &a->first;
+    arena_chunk **at = link;
+    arena_chunk *c;
+
+    while ((c = *at) != NULL && c->size < size)
+        at = &c->next;
+
+    if (c != NULL)
+        *at = c->next;
+    else
+    {
+        c = mm_malloc(sizeof(arena_chunk) + (size > ARENA_CHUNK ? size : ARENA_CHUNK));
+        if (c == NULL)
+            return -1;
+        c->size = mm_usable_size(c) - sizeof(arena_chunk);
+        STAT_ADD(arena_chunks, 1);
+    }
+    c->next = *link;
+    *link = c;
+
+    a->cur = c;
+    a->bump = (char *)(c + 1);
+    a->end = a->bump + c->size;
+    return 0;
+}
+
+/*
+ * mm_arena_alloc - carve size bytes out of arena a. They stay valid
+ *     until the arena is reset or destroyed.
+ */
+void *mm_arena_alloc(mm_arena_t *a, size_t size)
+{
+    char *p;
+
+    if (size > (size_t)-1 - ARENA_CHUNK)
+        return NULL;
+    /* a zero-size request still gets a unique pointer, never NULL */
+    size = size == 0 ? ALIGNMENT : ALIGN(size);
+
+    if ((size_t)(a->end - a->bump) < size && arena_next_chunk(a, size) < 0)
+        return NULL;
+
+    p = a->bump;
+    a->bump += size;
+    a->last = p;
+    STAT_ADD(arena_allocs, 1);
+    return p;
+}
+
+/*
+ * mm_arena_free - give back ptr, from mm_arena_alloc on a. Only the last
+ *     object handed out is actually reused; for any other, and for NULL,
+ *     this does nothing until the arena is reset.
+ */
+void mm_arena_free(mm_arena_t *a, void *ptr)
+{
+    if (ptr != NULL && ptr == a->last)
+    {
+        a->bump = a->last;
+        a->last = NULL;
+    }
+}
+
+/*
+ * mm_arena_reset - free everything allocated from arena a at once. The
+ *     chunks are kept for the allocations that follow.
+ */
+void mm_arena_reset(mm_arena_t *a)
+{
+    a->cur = NULL;
+    a->bump = a->end = a->last = NULL;
+    STAT_ADD(arena_resets, 1);
+}
+
+/*
+ * mm_arena_destroy - free arena a, its chunks and so everything
+ *     allocated from it
+ */
+void mm_arena_destroy(mm_arena_t *a)
+{
+    arena_chunk *c, *next;
+
+    for (c = a->first; c != NULL; c = next)
+    {
+        next = c->next;
+        mm_free(c);
+    }
+    mm_free(a);
+}
+
+/*
+ * grow_handle_table - double the handle table, chaining the new entries
+ *     as free. Returns -1 if the heap is exhausted.
+ */
+int grow_handle_table(void)
+{
+    int h, n = handle_count > 0 ? 2 * handle_count : HANDLE_TABLE_MIN;
+    handle_entry *t = mm_malloc(n * sizeof(handle_entry));
+
+    if (t == NULL)
+        return -1;
+    if (handle_table != NULL)
+    {
+        memcpy(t, handle_table, handle_count * sizeof(handle_entry));
+        mm_free(handle_table);
+    }
+    for (h = n - 1; h >= handle_count; h--)
+    {
+        t[h].ptr = NULL;
+        t[h].next = handle_free;
+        handle_free = h;
+    }
+    handle_table = t;
+    handle_count = n;
+    return 0;
+}
+
+/*
+ * mm_halloc - allocate a movable block of size bytes and return its
+ *     handle, or -1 if the heap is exhausted
+ */
+mm_handle_t mm_halloc(size_t size)
+{
+    char *ptr;
+    int h;
+
+    if (handle_free < 0 && grow_handle_table() < 0)
+        return -1;
+    if ((ptr = mm_malloc(size)) == NULL)
+        return -1;
+
+    h = handle_free;
+    handle_free = handle_table[h].next;
+    handle_table[h].ptr = ptr;
+    handle_table[h].locks = 0;
+
+    // A block with a region of its own is never moved
+    if (!IS_MAPPED(ptr))
+    {
+        *GET_PREV_TAG(ptr) |= HANDLE_BIT;
+        HANDLE_OF(GET_PREV_TAG(ptr)) = h;
+    }
+    return h;
+}
+
+/*
+ * mm_hlock - the address of the block of handle h, which stays valid
+ *     until the matching mm_hunlock. Locks nest.
+ */
+void *mm_hlock(mm_handle_t h)
+{
+    handle_table[h].locks++;
+    return handle_table[h].ptr;
+}
+
+/*
+ * mm_hunlock - undo one mm_hlock of handle h
+ */
+void mm_hunlock(mm_handle_t h)
+{
+    handle_table[h].locks--;
+}
+
+/*
+ * mm_hfree - free handle h and its block
+ */
+void mm_hfree(mm_handle_t h)
+{
+    mm_free(handle_table[h].ptr);
+    handle_table[h].ptr = NULL;
+    handle_table[h].next = handle_free;
+    handle_free = h;
+}
+
+/*
+ * append_free - make the len bytes at p, holding tag, a free block
+ *     linked after last, the end of the free list being rebuilt
+ */
+free_block *append_free(free_block *last, char *p, tag_t tag)
+{
+    free_block *b = (free_block *)p;
+
+    mark_dirty(b, sizeof(free_block));
+    b->size = tag;
+    SET_NEXT_FREE(b, NULL);
+    SET_PREV_FREE(b, last);
+    if (last != NULL)
+        SET_NEXT_FREE(last, b);
+    else
+        free_list_root = b;
+    free_list_tail = b;
+    return b;
+}
+
+/*
+ * mm_compact - slide the blocks of unlocked handles toward the start of
+ *     the heap, past the free blocks in front of them. Every stretch of
+ *     free space left between pinned blocks becomes a single free block,
+ *     the free list is rebuilt in address order, and the whole pages of
+ *     the free end of the heap are given back with mem_trim. Returns the
+ *     number of bytes the heap shrank by.
+ */
+size_t mm_compact(void)
+{
+    char *p, *next, *keep;
+    char *end = (char *)mem_heap_hi() + 1;
+    char *dst = NULL;          // start of the free space blocks slide into
+    tag_t gap_tag = 0;         // its tag, while it is a single free block
+    free_block *last = NULL;
+    size_t len, trimmed = 0;
+    tag_t tag;
+
+    STAT_ADD(compactions, 1);
+    flush_pending();
+    if (quick_count > 0)
+        flush_quick();
+    free_list_root = free_list_tail = NULL;
+    fit_rover = NULL;
+
+    for (p = mem_heap_lo(); p < end; p = next)
+    {
+        tag = *(tag_t *)p;
+        len = GET_BLOCK_LENGTH(p);
+        next = p + len;
+
+        if (!(tag & ALLOC_BIT))
+        {
+            gap_tag = dst == NULL ? tag : 0;
+            if (dst == NULL)
+                dst = p;
+            continue;
+        }
+        if (dst == NULL)
+            continue;
+
+        if ((tag & HANDLE_BIT) && handle_table[HANDLE_OF(p)].locks == 0)
+        {
+            memmove(dst, p, len);
+            handle_table[HANDLE_OF(dst)].ptr = dst + SIZE_T_SIZE;
+            mark_dirty(dst, len);
+            dst += len;
+            gap_tag = 0;
+            STAT_ADD(compact_moves, 1);
+            STAT_ADD(compact_move_bytes, len);
+            continue;
+        }
+
+        // A pinned block closes the free space in front of it
+        last = append_free(last, dst, gap_tag ? gap_tag : (tag_t)(p - dst));
+        dst = NULL;
+    }
+
+    if (dst != NULL)
+    {
+        keep = (char *)PAGE_UP(dst + MIN_BLOCK_SIZE);
+        if (keep < end && mem_trim(end - keep) == 0)
+        {
+            trimmed = end - keep;
+            end = keep;
+            gap_tag = 0;
+            STAT_ADD(trimmed_bytes, trimmed);
+        }
+        append_free(last, dst, gap_tag ? gap_tag : (tag_t)(end - dst));
+    }
+
+    if (DEBUG)
+    {
+        printf("Compacted the heap, giving back %lu bytes. The result:\n", (unsigned long)trimmed);
+        display_memory();
+    }
+
+    return trimmed;
+}
+
+/*
+ * mm_usable_size - the number of payload bytes block ptr can hold, which
+ *     may be more than were asked for
+ */
+size_t mm_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
+    if (IS_MAPPED(ptr))
+        return GET_BLOCK_LENGTH(GET_PREV_TAG(ptr)) - ((char *)ptr - REGION_OF(ptr));
+    return USER_SIZE_FROM_REAL(GET_BLOCK_LENGTH(GET_PREV_TAG(ptr)));
+}
+
+/*
+ * mm_free_sized - mm_free for callers that know the size they asked
+ *     for. Blocks here have no size classes and may be longer than
+ *     requested, so the tag is still what mm_free goes by; the size is
+ *     only checked against it in MM_CHECK builds.
+ */
+void mm_free_sized(void *ptr, size_t size)
+{
+    if (MM_CHECK && ptr != NULL && size > mm_usable_size(ptr))
+    {
+        fprintf(stderr, "mm_free_sized: block %p holds %lu bytes, not %lu\n", ptr, (unsigned long)mm_usable_size(ptr), (unsigned long)size);
+        exit(1);
+    }
+    mm_free(ptr);
+}
+
+/*
+ * expand_in_place - grow heap block p to want_size bytes, or to at least
+ *     min_size, without moving it: the block takes what it needs of the
+ *     free block after it and, if it ends the heap, grows the heap.
+ *     Whatever is left over goes back to the free list. Returns the new
+ *     block length, or 0 (and leaves p alone) if min_size is out of reach.
+ */
+size_t expand_in_place(void *p, size_t min_size, size_t want_size)
+{
+    size_t old_size = GET_BLOCK_LENGTH(p);
+    char *next_p = NEXT_BLOCK(p);
+    char *brk = (char *)mem_heap_hi() + 1;
+    size_t avail = old_size, new_size, rest;
+    tag_t aged = 0;
+    char *purged_lo = NULL, *purged_hi = NULL;
+    int merged = 0;
+
+    if (want_size < min_size)
+        want_size = min_size;
+    if (next_p < brk && !is_allocated(next_p))
+    {
+        avail += GET_BLOCK_LENGTH(next_p);
+        merged = 1;
+    }
+
+    // At the end of the heap, sbrk what is missing
+    if (avail < want_size && (char *)p + avail == brk)
+    {
+        size_t grow = want_size - avail;
+        if (mem_sbrk(grow) != (void *)-1)
+        {
+            avail += grow;
+            STAT_ADD(heap_grows, 1);
+            STAT_ADD(heap_grow_bytes, grow);
+        }
+    }
+    if (avail < min_size)
+        return 0;
+
+    if (merged)
+    {
+        aged = *(tag_t *)next_p & AGED_BIT;
+        get_purged(next_p, &purged_lo, &purged_hi);
+        remove_from_list((free_block *)next_p);
+        STAT_ADD(coalesce_next, 1);
+    }
+
+    new_size = avail < want_size ? avail : want_size;
+    rest = avail - new_size;
+    if (rest < params.split_min || rest < MIN_BLOCK_SIZE)
+    {
+        new_size = avail;
+        rest = 0;
+    }
+    mark_dirty(p, new_size + sizeof(free_block));
+    *(tag_t *)p = new_size | (*(tag_t *)p & HANDLE_BIT) | 1;
+    if (rest > 0)
+    {
+        tag_t *r = (tag_t *)((char *)p + new_size);
+        *r = rest | aged;
+        insert_into_list(r);
+        set_purged(r, purged_lo, purged_hi);
+        STAT_ADD(splits, 1);
     }
-    void *oldnext_p = NEXT_BLOCK(old_p);
-    size_t oldnext_size = GET_BLOCK_LENGTH(oldnext_p);
-    
-    // If there is enough space in the old block + the next free block, use it 
-    if (!is_allocated(oldnext_p) && oldnext_size + old_size >= new_size) {
-        *(size_t *)old_p = new_size | 1; // It is allocated
-        // Get new next block
+    return new_size;
+}
+
+/*
+ * mm_try_expand - grow block ptr where it is, to preferred_size bytes if
+ *     possible and to at least min_size otherwise. The block never
+ *     moves and never shrinks. Returns its new usable size, or 0 if it
+ *     cannot hold min_size without moving, in which case it is unchanged.
+ */
+size_t mm_try_expand(void *ptr, size_t min_size, size_t preferred_size)
+{
+    size_t usable = mm_usable_size(ptr);
+    size_t len;
+
+    if (preferred_size < min_size)
+        preferred_size = min_size;
+    if (preferred_size <= usable)
+        return usable;
+
+    if (IS_MAPPED(ptr))
+    {
+        // A region grows only if the pages after it are free
+        char *region = REGION_OF(ptr);
+        size_t payload_off = (char *)ptr - region;
+
+        len = PAGE_UP(payload_off + preferred_size);
+        if (preferred_size > MAX_BLOCK_LENGTH || len > MAX_BLOCK_LENGTH ||
+            mem_remap(region, len, 0) == (void *)-1)
+        {
+            if (min_size <= usable)
+                return usable;
+            len = PAGE_UP(payload_off + min_size);
+            if (min_size > MAX_BLOCK_LENGTH || len > MAX_BLOCK_LENGTH ||
+                mem_remap(region, len, 0) == (void *)-1)
+                return 0;
+        }
+        *GET_PREV_TAG(ptr) = len | 1;
+        STAT_ADD(expands, 1);
+        return len - payload_off;
+    }
+
+    if (min_size < usable)
+        min_size = usable;
+    len = expand_in_place(GET_PREV_TAG(ptr), REAL_SIZE_FROM_USER(min_size),
+                          REAL_SIZE_FROM_USER(preferred_size));
+    if (len == 0)
+        return 0;
+    if (USER_SIZE_FROM_REAL(len) > usable)
+        STAT_ADD(expands, 1);
+    return USER_SIZE_FROM_REAL(len);
+}
+
+/*
+ * mm_realloc - realloc using implicit simply linked list.
+ * Use the free space at old pointer if possible, else do a new malloc/copy/free
+ * u_* variables denote things that are as seen by the user:
+ *    sizes are payload sizes
+ *    pointer are pyload start pointers
+ * variables with no 'u_' prefix denote things that are as they are in memory:
+ *    sizes are actual block sizes
+ *    pointers are block start pointers
+ * *_p variables are pointers to blocks
+ * *_size variables are size variables
+ */
+void *mm_realloc(void *ptr, size_t size)
+{
+    if (IS_MAPPED(ptr))
+        return remap_block(ptr, size);
+
+    if (DEBUG)
+        display_memory();
+
+    size_t u_new_size = size;
+    size_t new_size = REAL_SIZE_FROM_USER(size);
+    void *u_old_p = ptr;
+    void *old_p = GET_PREV_TAG(ptr);
+    size_t old_size = GET_BLOCK_LENGTH(old_p);
+
+    if (DEBUG)
+        printf("User want to realloc %p(%lu) to size %lu\n", old_p, (unsigned long)old_size, (unsigned long)new_size);
+
+    if (old_size == new_size)
+        return ptr;
+    if (old_size == 0)
+        return mm_malloc(size);
+
+    // If there is enough space in the old block, just create a new free block after it
+    if (old_size >= new_size) {
+        if (DEBUG)  
+            printf("The old block is large enough\n");
+
+        STAT_ADD(realloc_inplace, 1);
+        // A tail too small to be a free block stays with the block
+        if (old_size - new_size < MIN_BLOCK_SIZE)
+            return u_old_p;
+
+        // Set the old block (it is allocated)
+        *(tag_t *)old_p = new_size | (*(tag_t *)old_p & HANDLE_BIT) | 1;
+
+        // 'newnext' variables correspond to the free block which has just been created
         void *newnext_p = NEXT_BLOCK(old_p);
-        // Compute its size
-        size_t newnext_size = old_size + oldnext_size - new_size;
-        // Set its value (it is unallocated)
-        *(size_t *)newnext_p = newnext_size;
+        size_t newnext_size = old_size - new_size;
+        // The 'allocated' bit is purposefully not set
+        *(tag_t *)newnext_p = newnext_size;
+        coalesce(newnext_p);
+        STAT_ADD(splits, 1);
+        return u_old_p;
+    }
+    // If there is enough space in the old block + the next free block or the heap tail, use it
+    if (expand_in_place(old_p, new_size, new_size) != 0) {
+        STAT_ADD(realloc_inplace, 1);
         return u_old_p;
     }
 
+    size_t u_old_size = USER_SIZE_FROM_REAL(old_size);
+
+    // A block growing past MAP_THRESHOLD moves to a region of its own by remapping its pages
+    if (u_new_size >= MAP_THRESHOLD)
+        return move_to_map(u_old_p, u_old_size, u_new_size);
+
     // There is not enough space, malloc a new block, copy between the two and free the old block
     void *u_new_p = mm_malloc(u_new_size);
     if (u_new_p == NULL)
         return NULL;
-    size_t u_old_size = old_size - SIZE_T_SIZE;
 
     // Set the copy_size to min(u_new_size, u_old_size)
-    size_t u_copy_size = u_new_size < u_new_size ? u_new_size : u_old_size;
+    size_t u_copy_size = u_new_size < u_old_size ? u_new_size : u_old_size;
     // Copy copy_size bytes from old_ptr to new_ptr
     memcpy(u_new_p, u_old_p, u_copy_size);
+    STAT_ADD(realloc_copy, 1);
+    STAT_ADD(realloc_copy_bytes, u_copy_size);
     // Free the old ptr
     mm_free(u_old_p);
 
     return u_new_p;
 }
+
+#if MM_THREADS
+/*
+ * maintenance - the body of the maintenance thread
+ */
+static void *maintenance(void *arg)
+{
+    struct timespec nap = {0, MAINT_NAP_NS};
+    int idle = 1;
+
+    while (!__atomic_load_n(&maint_stop, __ATOMIC_ACQUIRE))
+    {
+        if (__atomic_load_n(&pending, __ATOMIC_RELAXED) != NULL)
+        {
+            pthread_mutex_lock(&heap_lock);
+            flush_pending();
+            pthread_mutex_unlock(&heap_lock);
+            idle = 0;
+            continue;
+        }
+        if (!idle)
+        {
+            pthread_mutex_lock(&heap_lock);
+            if (PURGE)
+                purge_scan();
+            pthread_mutex_unlock(&heap_lock);
+            idle = 1;
+        }
+        nanosleep(&nap, NULL);
+    }
+    return arg;
+}
+#endif
+
+/*
+ * mm_start_maintenance - start the maintenance thread, after which
+ *     mm_free only queues blocks for it. Returns -1 if it could not be
+ *     started, as always without MM_THREADS.
+ */
+int mm_start_maintenance(void)
+{
+#if MM_THREADS
+    if (maint_running)
+        return 0;
+    maint_stop = 0;
+    if (pthread_create(&maint_thread, NULL, maintenance, NULL) != 0)
+        return -1;
+    __atomic_store_n(&maint_running, 1, __ATOMIC_RELEASE);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * mm_stop_maintenance - stop the maintenance thread and free what it
+ *     left queued
+ */
+void mm_stop_maintenance(void)
+{
+#if MM_THREADS
+    if (!maint_running)
+        return;
+    __atomic_store_n(&maint_running, 0, __ATOMIC_SEQ_CST);
+    // Let the mm_free calls that saw it still set finish their push
+    while (__atomic_load_n(&maint_pushing, __ATOMIC_SEQ_CST) != 0)
+        sched_yield();
+    __atomic_store_n(&maint_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(maint_thread, NULL);
+
+    pthread_mutex_lock(&heap_lock);
+    flush_pending();
+    pthread_mutex_unlock(&heap_lock);
+#endif
+}
+
+#if MM_THREADS
+/*
+ * The locked entry points
+ */
+#undef mm_init
+#undef mm_malloc
+#undef mm_free
+#undef mm_free_sized
+#undef mm_malloc_batch
+#undef mm_free_batch
+#undef mm_usable_size
+#undef mm_realloc
+#undef mm_try_expand
+#undef mm_calloc
+#undef mm_memalign
+#undef mm_aligned_alloc
+#undef mm_arena_create
+#undef mm_arena_alloc
+#undef mm_arena_free
+#undef mm_arena_reset
+#undef mm_arena_destroy
+#undef mm_halloc
+#undef mm_hlock
+#undef mm_hunlock
+#undef mm_hfree
+#undef mm_compact
+#undef mm_get_stats
+#undef mm_get_params
+#undef mm_set_params
+#undef mm_heap_walk
+
+#define LOCKED(type, name, params, args)        \
+    type name params                            \
+    {                                           \
+        type r;                                 \
+        pthread_mutex_lock(&heap_lock);         \
+        r = name##_unlocked args;               \
+        pthread_mutex_unlock(&heap_lock);       \
+        return r;                               \
+    }
+
+#define LOCKED_VOID(name, params, args)         \
+    void name params                            \
+    {                                           \
+        pthread_mutex_lock(&heap_lock);         \
+        name##_unlocked args;                   \
+        pthread_mutex_unlock(&heap_lock);       \
+    }
+
+LOCKED(int, mm_init, (void), ())
+LOCKED(void *, mm_malloc, (size_t size), (size))
+LOCKED(size_t, mm_malloc_batch, (size_t size, size_t n, void **out), (size, n, out))
+LOCKED_VOID(mm_free_batch, (void **ptrs, size_t n), (ptrs, n))
+LOCKED(size_t, mm_usable_size, (void *ptr), (ptr))
+LOCKED(void *, mm_realloc, (void *ptr, size_t size), (ptr, size))
+LOCKED(size_t, mm_try_expand, (void *ptr, size_t min_size, size_t preferred_size), (ptr, min_size, preferred_size))
+LOCKED(void *, mm_calloc, (size_t nmemb, size_t size), (nmemb, size))
+LOCKED(void *, mm_memalign, (size_t alignment, size_t size), (alignment, size))
+LOCKED(void *, mm_aligned_alloc, (size_t alignment, size_t size), (alignment, size))
+LOCKED(mm_arena_t *, mm_arena_create, (void), ())
+LOCKED(void *, mm_arena_alloc, (mm_arena_t *arena, size_t size), (arena, size))
+LOCKED_VOID(mm_arena_free, (mm_arena_t *arena, void *ptr), (arena, ptr))
+LOCKED_VOID(mm_arena_reset, (mm_arena_t *arena), (arena))
+LOCKED_VOID(mm_arena_destroy, (mm_arena_t *arena), (arena))
+LOCKED(mm_handle_t, mm_halloc, (size_t size), (size))
+LOCKED(void *, mm_hlock, (mm_handle_t h), (h))
+LOCKED_VOID(mm_hunlock, (mm_handle_t h), (h))
+LOCKED_VOID(mm_hfree, (mm_handle_t h), (h))
+LOCKED(size_t, mm_compact, (void), ())
+LOCKED(int, mm_get_stats, (mm_stats_t *st), (st))
+LOCKED_VOID(mm_get_params, (mm_params_t *p), (p))
+LOCKED(int, mm_set_params, (const mm_params_t *p), (p))
+LOCKED_VOID(mm_heap_walk, (mm_walk_fn fn, void *arg), (fn, arg))
+
+/*
+ * mm_free - with the maintenance thread running, a single push on the
+ *     pending stack. Blocks with a region of their own are still unmapped
+ *     at once, so that the thread never calls into mem_unmap. A push is
+ *     counted in maint_pushing from before its second look at
+ *     maint_running, so mm_stop_maintenance can wait for it to land.
+ */
+void mm_free(void *ptr)
+{
+    void *top;
+    int pushed = 0;
+
+    if (ptr != NULL && !IS_MAPPED(ptr) &&
+        __atomic_load_n(&maint_running, __ATOMIC_ACQUIRE))
+    {
+        __atomic_add_fetch(&maint_pushing, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&maint_running, __ATOMIC_SEQ_CST))
+        {
+            top = __atomic_load_n(&pending, __ATOMIC_RELAXED);
+            do
+                *(void **)ptr = top;
+            while (!__atomic_compare_exchange_n(&pending, &top, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+            pushed = 1;
+        }
+        __atomic_sub_fetch(&maint_pushing, 1, __ATOMIC_RELEASE);
+        if (pushed)
+            return;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    mm_free_unlocked(ptr);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * mm_free_sized - mm_free, after the size check of mm_free_sized_unlocked,
+ *     which is made under the lock and only returns if it passes
+ */
+void mm_free_sized(void *ptr, size_t size)
+{
+    if (MM_CHECK && ptr != NULL)
+    {
+        pthread_mutex_lock(&heap_lock);
+        if (size > mm_usable_size_unlocked(ptr))
+            mm_free_sized_unlocked(ptr, size);
+        pthread_mutex_unlock(&heap_lock);
+    }
+    mm_free(ptr);
+}
+#endif
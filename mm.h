@@ -3,7 +3,158 @@
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+extern size_t mm_usable_size(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern size_t mm_try_expand(void *ptr, size_t min_size, size_t preferred_size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+
+/*
+ * Arenas: objects bump-allocated from chunks of the heap and freed all
+ * together by mm_arena_reset, in constant time, or mm_arena_destroy.
+ * mm_arena_free is optional; it only reclaims the last object handed
+ * out. An arena does not survive mm_init.
+ */
+typedef struct mm_arena mm_arena_t;
+
+extern mm_arena_t *mm_arena_create(void);
+extern void *mm_arena_alloc(mm_arena_t *arena, size_t size);
+extern void mm_arena_free(mm_arena_t *arena, void *ptr);
+extern void mm_arena_reset(mm_arena_t *arena);
+extern void mm_arena_destroy(mm_arena_t *arena);
+
+/*
+ * Movable blocks. mm_halloc returns a handle, or -1, rather than a
+ * pointer; mm_hlock gives the current address of the block, which stays
+ * put until the matching mm_hunlock. mm_compact slides the blocks of
+ * unlocked handles toward mem_heap_lo(), merges the free space they
+ * leave and trims the heap, returning the number of bytes trimmed.
+ * A locked address must not be passed to mm_realloc or mm_free. Handles
+ * do not survive mm_init.
+ */
+typedef int mm_handle_t;
+
+extern mm_handle_t mm_halloc(size_t size);
+extern void *mm_hlock(mm_handle_t h);
+extern void mm_hunlock(mm_handle_t h);
+extern void mm_hfree(mm_handle_t h);
+extern size_t mm_compact(void);
+
+/*
+ * Allocator-internal counters. Build with -DMM_STATS=1 to enable them;
+ * otherwise every update in mm.c compiles to nothing. The counters are
+ * reset by mm_init.
+ */
+#ifndef MM_STATS
+#define MM_STATS 0
+#endif
+
+typedef struct {
+    unsigned long searches;           /* free-list searches in mm_malloc */
+    unsigned long search_visits;      /* free-list nodes visited by them */
+    unsigned long splits;             /* blocks split in two */
+    unsigned long coalesce_next;      /* merges with the next block */
+    unsigned long coalesce_prev;      /* merges with the previous block */
+    unsigned long inserts;            /* calls to insert_into_list */
+    unsigned long insert_scan;        /* blocks stepped over by those calls */
+    unsigned long heap_grows;         /* calls to increase_heap_size */
+    unsigned long heap_grow_bytes;    /* bytes requested from mem_sbrk */
+    unsigned long realloc_inplace;    /* reallocs served without moving */
+    unsigned long realloc_copy;       /* reallocs that had to copy */
+    unsigned long realloc_copy_bytes; /* bytes copied by reallocs */
+    unsigned long realloc_remap;      /* reallocs that moved by remapping */
+    unsigned long remapped_bytes;     /* bytes moved without a copy */
+    unsigned long expands;            /* blocks grown by mm_try_expand */
+    unsigned long purges;             /* free blocks whose pages were purged */
+    unsigned long purged_bytes;       /* bytes given back by those purges */
+    unsigned long maps;               /* blocks given a region of their own */
+    unsigned long mapped_bytes;       /* bytes in those regions */
+    unsigned long zeroed_bytes;       /* bytes cleared by mm_calloc */
+    unsigned long zero_skipped_bytes; /* bytes it knew were already zero */
+    unsigned long aligned;            /* heap blocks placed by mm_memalign */
+    unsigned long align_gap_bytes;    /* bytes it left free in front of them */
+    unsigned long batch_allocs;       /* blocks carved by mm_malloc_batch */
+    unsigned long batch_frees;        /* blocks released by mm_free_batch */
+    unsigned long batch_runs;         /* runs of adjacent blocks it freed */
+    unsigned long arena_chunks;       /* chunks taken from the heap by arenas */
+    unsigned long arena_allocs;       /* objects bump-allocated in arenas */
+    unsigned long arena_resets;       /* calls to mm_arena_reset */
+    unsigned long compactions;        /* calls to mm_compact */
+    unsigned long compact_moves;      /* handle blocks moved by them */
+    unsigned long compact_move_bytes; /* bytes moved */
+    unsigned long trimmed_bytes;      /* bytes of heap given back by them */
+    unsigned long quick_frees;        /* frees deferred to a quick list */
+    unsigned long quick_hits;         /* mallocs served from a quick list,
+                                         each sparing a search, a split and
+                                         the merge and insert of a free */
+    unsigned long quick_flushes;      /* batch coalesces of the quick lists */
+    unsigned long quick_flushed;      /* blocks coalesced by them */
+    unsigned long pending_flushes;    /* batches of queued frees freed */
+    unsigned long pending_frees;      /* blocks freed in those batches */
+} mm_stats_t;
+
+extern int mm_get_stats(mm_stats_t *st);
+
+/*
+ * Thread-safe build. Build with -DMM_THREADS=1 -pthread to have every
+ * entry point hold one heap lock. mm_start_maintenance then starts a
+ * background thread that does the work of mm_free: mm_free only queues
+ * the block, which the thread coalesces and inserts in the free list,
+ * purging pages while it is otherwise idle. mm_stop_maintenance stops
+ * it and frees what is still queued. Without MM_THREADS,
+ * mm_start_maintenance fails with -1.
+ */
+#ifndef MM_THREADS
+#define MM_THREADS 0
+#endif
+
+extern int mm_start_maintenance(void);
+extern void mm_stop_maintenance(void);
+
+/*
+ * Placement policies for mm_malloc's free-list search: the first block
+ * that fits, the first one after where the last search stopped, the
+ * smallest one that fits, or the smallest among the first fit_k that fit.
+ */
+#define MM_FIT_FIRST 0
+#define MM_FIT_NEXT  1
+#define MM_FIT_BEST  2
+#define MM_FIT_GOOD  3
+#define MM_FIT_POLICIES 4
+#define MM_FIT_NAMES {"first", "next", "best", "good"}
+
+/*
+ * Policy knobs. They take effect at the next mm_init. Their defaults
+ * are the MM_INIT_HEAP, MM_GROW_FACTOR, MM_SPLIT_MIN, MM_FIT and
+ * MM_FIT_K macros of mm.c, which a tuned build overrides with a header
+ * written by mmtune: build with -DMM_CONFIG='"header.h"' to include it.
+ * mm_set_params returns -1, and changes nothing, if a value is out of
+ * range.
+ */
+typedef struct {
+    size_t init_heap;     /* bytes of heap set up by mm_init */
+    double grow_factor;   /* the heap grows by this times the request */
+    size_t split_min;     /* smallest remainder split off a free block */
+    int fit;              /* placement policy, one of MM_FIT_* */
+    int fit_k;            /* candidates examined by MM_FIT_GOOD */
+} mm_params_t;
+
+extern void mm_get_params(mm_params_t *p);
+extern int mm_set_params(const mm_params_t *p);
+
+/*
+ * Heap introspection. mm_heap_walk calls fn once for every block in the
+ * heap, in address order, with the address of the block, its total size
+ * in bytes (header included) and whether it is allocated.
+ */
+typedef void (*mm_walk_fn)(void *block, size_t size, int allocated,
+                           void *arg);
+
+extern void mm_heap_walk(mm_walk_fn fn, void *arg);
 
 
 /* 
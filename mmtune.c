@@ -0,0 +1,427 @@
+/*
+ * mmtune.c - Searches the policy knobs of mm.c (see mm_params_t in
+ *     mm.h) for the best trade-offs between space utilization and
+ *     throughput over a set of traces.
+ *
+ * Every candidate configuration is run on every trace: once to measure
+ * its utilization, the way mdriver does, and once under the timer. The
+ * candidates come from a grid of values for each knob, or with -n from
+ * random samples of their ranges. mmtune prints every configuration,
+ * marks those on the Pareto frontier of utilization vs throughput, and
+ * picks the one with the best mdriver performance index. With -o it
+ * writes that configuration as a header for a tuned build of mm.c.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "fsecs.h"
+#include "trace.h"
+#include "config.h"
+
+#define MAXLINE 1024 /* max string size */
+
+/* The grid swept by default */
+static size_t grid_init_heap[] = {256, 4096, 64*1024};
+static double grid_grow_factor[] = {1.0, 1.5, 2.0, 4.0};
+static size_t grid_split_min[] = {8, 16, 32, 64};
+static int grid_fit[] = {MM_FIT_FIRST, MM_FIT_NEXT, MM_FIT_BEST, MM_FIT_GOOD};
+static char *fit_names[] = MM_FIT_NAMES;
+
+#define NELEMS(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+/* One candidate configuration and how it did */
+typedef struct {
+    mm_params_t params;
+    int ok;              /* every trace ran without an allocator failure */
+    double util;         /* average utilization over the traces */
+    double kops;         /* throughput over all traces, in Kops/s */
+    double perfindex;    /* mdriver's performance index */
+    int pareto;          /* no other configuration beats it on both */
+} candidate_t;
+
+int verbose = 0;         /* read by the timing package */
+
+static trace_t **traces; /* the trace set */
+static int num_traces;
+
+static int run_util(trace_t *trace, double *util);
+static void run_speed(void *ptr);
+static void eval_candidate(candidate_t *c);
+static void mark_pareto(candidate_t *cands, int n);
+static void write_header(char *path, candidate_t *c);
+static char *fit_label(mm_params_t *p);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+    char c;
+    char tracedir[MAXLINE] = TRACEDIR;
+    char *default_tracefiles[] = {DEFAULT_TRACEFILES, NULL};
+    char **tracefiles = NULL;
+    int num_files = 0;
+    int samples = 0;     /* if > 0, random search with that many samples */
+    char *header = NULL; /* where to write the chosen configuration */
+    candidate_t *cands, *best;
+    mm_params_t defaults;
+    int i, j, k, l, n;
+
+    while ((c = getopt(argc, argv, "f:t:n:o:hv")) != EOF) {
+	switch (c) {
+	case 'f': /* Add a trace file (relative to curr dir) */
+	    if ((tracefiles = realloc(tracefiles, (num_files + 2) * sizeof(char *))) == NULL) {
+		perror("realloc failed in main");
+		exit(1);
+	    }
+	    strcpy(tracedir, "./");
+	    tracefiles[num_files++] = optarg;
+	    tracefiles[num_files] = NULL;
+	    break;
+	case 't': /* Directory where the default traces are located */
+	    if (tracefiles != NULL)
+		break;
+	    strcpy(tracedir, optarg);
+	    if (tracedir[strlen(tracedir)-1] != '/')
+		strcat(tracedir, "/");
+	    break;
+	case 'n': /* Random search instead of the grid */
+	    if ((samples = atoi(optarg)) < 1) {
+		fprintf(stderr, "ERROR: -n needs a positive sample count\n");
+		exit(1);
+	    }
+	    break;
+	case 'o': /* Write the chosen configuration as a header */
+	    header = optarg;
+	    break;
+	case 'v':
+	    verbose = 1;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (tracefiles == NULL) {
+	tracefiles = default_tracefiles;
+	num_files = sizeof(default_tracefiles) / sizeof(char *) - 1;
+    }
+
+    /* Read the trace set once */
+    if ((traces = (trace_t **)malloc(num_files * sizeof(trace_t *))) == NULL) {
+	perror("malloc failed in main");
+	exit(1);
+    }
+    for (i = 0; i < num_files; i++)
+	traces[i] = read_trace(tracedir, tracefiles[i]);
+    num_traces = num_files;
+
+    init_fsecs();
+    mem_init();
+
+    /* Build the candidate configurations */
+    n = samples > 0 ? samples :
+	NELEMS(grid_init_heap) * NELEMS(grid_grow_factor) * 
+	NELEMS(grid_split_min) * NELEMS(grid_fit);
+    if ((cands = (candidate_t *)calloc(n, sizeof(candidate_t))) == NULL) {
+	perror("calloc failed in main");
+	exit(1);
+    }
+    if (samples > 0) {
+	srand(getpid());
+	for (i = 0; i < n; i++) {
+	    /* init_heap log-uniform in [64, 1M], split_min in [8, 256] */
+	    cands[i].params.init_heap = (size_t)exp(log(64) +
+		(log(1 << 20) - log(64)) * rand() / RAND_MAX);
+	    cands[i].params.grow_factor = 1.0 + 7.0 * rand() / RAND_MAX;
+	    cands[i].params.split_min = ALIGNMENT * (1 + rand() % 32);
+	    cands[i].params.fit = rand() % MM_FIT_POLICIES;
+	    cands[i].params.fit_k = 1 + rand() % 16;
+	}
+    }
+    else {
+	mm_get_params(&defaults);
+	n = 0;
+	for (i = 0; i < NELEMS(grid_init_heap); i++)
+	    for (j = 0; j < NELEMS(grid_grow_factor); j++)
+		for (k = 0; k < NELEMS(grid_split_min); k++)
+		    for (l = 0; l < NELEMS(grid_fit); l++) {
+			cands[n].params.init_heap = grid_init_heap[i];
+			cands[n].params.grow_factor = grid_grow_factor[j];
+			cands[n].params.split_min = grid_split_min[k];
+			cands[n].params.fit = grid_fit[l];
+			cands[n].params.fit_k = defaults.fit_k;
+			n++;
+		    }
+    }
+
+    /* Run them all */
+    for (i = 0; i < n; i++)
+	eval_candidate(&cands[i]);
+    mark_pareto(cands, n);
+
+    /* Report, and pick the best performance index */
+    best = NULL;
+    printf("%9s%7s%7s%10s%8s%10s%7s%8s\n", "init", "grow", "split", "fit",
+	   "util", "Kops", "perf", "pareto");
+    for (i = 0; i < n; i++) {
+	if (!cands[i].ok) {
+	    printf("%9lu%7.2f%7lu%10s%8s%10s%7s%8s\n",
+		   (unsigned long)cands[i].params.init_heap,
+		   cands[i].params.grow_factor,
+		   (unsigned long)cands[i].params.split_min,
+		   fit_label(&cands[i].params), "-", "-", "-", "failed");
+	    continue;
+	}
+	printf("%9lu%7.2f%7lu%10s%7.1f%%%10.0f%7.1f%8s\n",
+	       (unsigned long)cands[i].params.init_heap,
+	       cands[i].params.grow_factor,
+	       (unsigned long)cands[i].params.split_min,
+	       fit_label(&cands[i].params),
+	       cands[i].util * 100.0, cands[i].kops, cands[i].perfindex,
+	       cands[i].pareto ? "*" : "");
+	if (best == NULL || cands[i].perfindex > best->perfindex)
+	    best = &cands[i];
+    }
+    if (best == NULL) {
+	printf("No configuration ran the whole trace set\n");
+	exit(1);
+    }
+    printf("Best: init_heap %lu, grow_factor %.2f, split_min %lu, fit %s "
+	   "(util %.1f%%, %.0f Kops, perf index %.1f)\n",
+	   (unsigned long)best->params.init_heap, best->params.grow_factor,
+	   (unsigned long)best->params.split_min, fit_label(&best->params),
+	   best->util * 100.0,
+	   best->kops, best->perfindex);
+    if (header)
+	write_header(header, best);
+
+    for (i = 0; i < num_traces; i++)
+	free_trace(traces[i]);
+    free(traces);
+    free(cands);
+    exit(0);
+}
+
+/*
+ * run_util - replay a trace and measure its utilization as mdriver
+ *     does: peak payload over the final heap size. Returns 0 if the
+ *     allocator fails on the trace.
+ */
+static int run_util(trace_t *trace, double *util)
+{
+    int i, k, index, size, count;
+    int total_size = 0, max_total_size = 0;
+    char *p;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	return 0;
+
+    for (i = 0; i < trace->num_ops; i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	switch (trace->ops[i].type) {
+	case ALLOC:
+	case CALLOC:
+	case MEMALIGN:
+	    if (trace->ops[i].type == CALLOC)
+		p = mm_calloc(1, size);
+	    else if (trace->ops[i].type == MEMALIGN)
+		p = mm_memalign(trace->ops[i].align, size);
+	    else
+		p = mm_malloc(size);
+	    if (p == NULL)
+		return 0;
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    total_size += size;
+	    break;
+	case REALLOC:
+	    if ((p = mm_realloc(trace->blocks[index], size)) == NULL)
+		return 0;
+	    total_size += size - trace->block_sizes[index];
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+	case FREE:
+	    mm_free(trace->blocks[index]);
+	    total_size -= trace->block_sizes[index];
+	    break;
+	case BATCH_ALLOC:
+	    count = trace->ops[i].count;
+	    if (mm_malloc_batch(size, count,
+				(void **)&trace->blocks[index]) < (size_t)count)
+		return 0;
+	    for (k = 0; k < count; k++)
+		trace->block_sizes[index + k] = size;
+	    total_size += count * size;
+	    break;
+	case BATCH_FREE:
+	    count = trace->ops[i].count;
+	    for (k = 0; k < count; k++)
+		total_size -= trace->block_sizes[index + k];
+	    mm_free_batch((void **)&trace->blocks[index], count);
+	    break;
+	}
+	if (total_size > max_total_size)
+	    max_total_size = total_size;
+    }
+
+    *util = (double)max_total_size / (double)mem_footprint_hwm();
+    return 1;
+}
+
+/*
+ * run_speed - the function timed by fsecs: replay the trace ptr
+ */
+static void run_speed(void *ptr)
+{
+    trace_t *trace = (trace_t *)ptr;
+    int i, index;
+
+    mem_reset_brk();
+    mm_init();
+
+    for (i = 0; i < trace->num_ops; i++) {
+	index = trace->ops[i].index;
+	switch (trace->ops[i].type) {
+	case ALLOC:
+	    trace->blocks[index] = mm_malloc(trace->ops[i].size);
+	    break;
+	case CALLOC:
+	    trace->blocks[index] = mm_calloc(1, trace->ops[i].size);
+	    break;
+	case MEMALIGN:
+	    trace->blocks[index] = mm_memalign(trace->ops[i].align,
+					       trace->ops[i].size);
+	    break;
+	case REALLOC:
+	    trace->blocks[index] = mm_realloc(trace->blocks[index],
+					      trace->ops[i].size);
+	    break;
+	case FREE:
+	    mm_free(trace->blocks[index]);
+	    break;
+	case BATCH_ALLOC:
+	    mm_malloc_batch(trace->ops[i].size, trace->ops[i].count,
+			    (void **)&trace->blocks[index]);
+	    break;
+	case BATCH_FREE:
+	    mm_free_batch((void **)&trace->blocks[index], trace->ops[i].count);
+	    break;
+	}
+    }
+}
+
+/*
+ * eval_candidate - run a configuration on the whole trace set
+ */
+static void eval_candidate(candidate_t *c)
+{
+    double util, total_util = 0, ops = 0, secs = 0, p2;
+    int i;
+
+    if (mm_set_params(&c->params) < 0)
+	return;
+    if (verbose)
+	printf("Running init_heap %lu, grow_factor %.2f, split_min %lu, fit %s\n",
+	       (unsigned long)c->params.init_heap, c->params.grow_factor,
+	       (unsigned long)c->params.split_min, fit_label(&c->params));
+
+    for (i = 0; i < num_traces; i++) {
+	if (!run_util(traces[i], &util))
+	    return;
+	total_util += util;
+	ops += traces[i]->num_ops;
+	secs += fsecs(run_speed, traces[i]);
+    }
+
+    c->ok = 1;
+    c->util = total_util / num_traces;
+    c->kops = ops / secs / 1e3;
+    p2 = ops / secs < AVG_LIBC_THRUPUT ? (ops / secs) / AVG_LIBC_THRUPUT : 1.0;
+    c->perfindex = (UTIL_WEIGHT * c->util + (1.0 - UTIL_WEIGHT) * p2) * 100.0;
+}
+
+/*
+ * mark_pareto - flag the configurations that no other one beats on
+ *     both utilization and throughput
+ */
+static void mark_pareto(candidate_t *cands, int n)
+{
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+	if (!cands[i].ok)
+	    continue;
+	cands[i].pareto = 1;
+	for (j = 0; j < n; j++)
+	    if (j != i && cands[j].ok &&
+		cands[j].util >= cands[i].util && cands[j].kops >= cands[i].kops &&
+		(cands[j].util > cands[i].util || cands[j].kops > cands[i].kops)) {
+		cands[i].pareto = 0;
+		break;
+	    }
+    }
+}
+
+/*
+ * write_header - write a configuration as the MM_* defaults of mm.c
+ */
+static void write_header(char *path, candidate_t *c)
+{
+    FILE *f;
+
+    if ((f = fopen(path, "w")) == NULL) {
+	perror(path);
+	exit(1);
+    }
+    fprintf(f, "/*\n * %s - mm.c policy knobs chosen by mmtune over %d traces\n"
+	    " *     (util %.1f%%, %.0f Kops, perf index %.1f).\n"
+	    " *     Build mm.c with -DMM_CONFIG='\"%s\"' to use them.\n */\n",
+	    path, num_traces, c->util * 100.0, c->kops, c->perfindex, path);
+    fprintf(f, "#define MM_INIT_HEAP %lu\n", (unsigned long)c->params.init_heap);
+    fprintf(f, "#define MM_GROW_FACTOR %.4f\n", c->params.grow_factor);
+    fprintf(f, "#define MM_SPLIT_MIN %lu\n", (unsigned long)c->params.split_min);
+    fprintf(f, "#define MM_FIT %d /* %s */\n", c->params.fit, fit_names[c->params.fit]);
+    fprintf(f, "#define MM_FIT_K %d\n", c->params.fit_k);
+    fclose(f);
+    printf("Wrote %s\n", path);
+}
+
+/*
+ * fit_label - name of the placement policy of p, for the reports
+ */
+static char *fit_label(mm_params_t *p)
+{
+    static char label[MAXLINE];
+
+    if (p->fit == MM_FIT_GOOD)
+	sprintf(label, "%s(%d)", fit_names[p->fit], p->fit_k);
+    else
+	strcpy(label, fit_names[p->fit]);
+    return label;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mmtune [-hv] [-f <file>]... [-t <dir>] [-n <samples>] "
+	    "[-o <header>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-f <file>    Tune on <file> (may be repeated).\n");
+    fprintf(stderr, "\t-h           Print this message.\n");
+    fprintf(stderr, "\t-n <samples> Random search with <samples> configurations.\n");
+    fprintf(stderr, "\t-o <header>  Write the best configuration to <header>.\n");
+    fprintf(stderr, "\t-t <dir>     Directory to find default traces.\n");
+    fprintf(stderr, "\t-v           Print each configuration as it runs.\n");
+}
@@ -0,0 +1,85 @@
+/*
+ * nullmm.c - A no-op allocator engine.
+ *
+ * mdriver replays each trace against these routines under the same
+ * timer as the real allocator. The time it measures is the cost of the
+ * replay loop and the timing package alone, which mdriver subtracts from
+ * the allocator's gross time. The routines live in their own file so
+ * that, like mm_malloc and friends, every call is a real call that the
+ * compiler cannot inline into the replay loop.
+ */
+#include <stdlib.h>
+#include "nullmm.h"
+
+/* Number of preassigned addresses handed out in turn by null_malloc */
+#define NULL_ADDRS 64
+
+static char null_heap[NULL_ADDRS * 8];
+static char *null_addrs[NULL_ADDRS];
+static unsigned null_next;
+
+/*
+ * null_init - preassign the addresses null_malloc returns
+ */
+void null_init(void)
+{
+    int i;
+
+    for (i = 0; i < NULL_ADDRS; i++)
+	null_addrs[i] = null_heap + 8*i;
+    null_next = 0;
+}
+
+/*
+ * null_malloc - return the next preassigned address
+ */
+void *null_malloc(size_t size)
+{
+    return null_addrs[null_next++ % NULL_ADDRS];
+}
+
+/*
+ * null_free - do nothing
+ */
+void null_free(void *ptr)
+{
+}
+
+/*
+ * null_realloc - keep the block where it is
+ */
+void *null_realloc(void *ptr, size_t size)
+{
+    return ptr;
+}
+
+/*
+ * null_calloc - return the next preassigned address, without clearing it
+ */
+void *null_calloc(size_t nmemb, size_t size)
+{
+    return null_addrs[null_next++ % NULL_ADDRS];
+}
+
+/*
+ * null_memalign - return the next preassigned address, aligned or not
+ */
+void *null_memalign(size_t alignment, size_t size)
+{
+    return null_addrs[null_next++ % NULL_ADDRS];
+}
+
+/*
+ * null_malloc_batch - claim to have filled out[], leaving it as it is
+ */
+size_t null_malloc_batch(size_t size, size_t n, void **out)
+{
+    return n;
+}
+
+/*
+ * null_free_batch - do nothing
+ */
+void null_free_batch(void **ptrs, size_t n)
+{
+}
@@ -0,0 +1,14 @@
+/*
+ * nullmm.h - a do-nothing allocator with the same calling interface as
+ *     mm.c, used by mdriver to measure the cost of the replay harness
+ */
+#include <stddef.h>
+
+void null_init(void);
+void *null_malloc(size_t size);
+void null_free(void *ptr);
+void *null_realloc(void *ptr, size_t size);
+void *null_calloc(size_t nmemb, size_t size);
+void *null_memalign(size_t alignment, size_t size);
+size_t null_malloc_batch(size_t size, size_t n, void **out);
+void null_free_batch(void **ptrs, size_t n);
@@ -0,0 +1,146 @@
+/*
+ * runenv.c - Stabilize and describe the benchmark run environment.
+ *
+ * Timings taken on a shared host move around with scheduling, CPU
+ * migration and frequency scaling. These routines let mdriver pin
+ * itself to one core and raise its priority before the timed phases,
+ * and print the facts about the machine that a reader needs to judge
+ * whether two sets of results are comparable.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include "runenv.h"
+
+#define RUNENV_MAXLINE 256
+
+/* Nice value requested by runenv_raise_priority: the lowest there is */
+#define RUNENV_NICE -20
+
+/* function prototypes */
+static int read_line(char *path, char *buf, int len);
+static void cpu_model(char *buf, int len);
+
+/*
+ * runenv_pin_cpu - restrict the calling process to the given core.
+ *     Returns 0 on success and -1 (with errno set) on failure.
+ */
+int runenv_pin_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+	errno = EINVAL;
+	return -1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+/*
+ * runenv_raise_priority - give the process the highest priority, i.e.
+ *     the lowest nice value, RUNENV_NICE. Returns 0 on success and -1 on
+ *     failure, typically EACCES or EPERM for unprivileged users.
+ */
+int runenv_raise_priority(void)
+{
+    return setpriority(PRIO_PROCESS, 0, RUNENV_NICE);
+}
+
+/*
+ * runenv_print - print the CPU model, the frequency governor and current
+ *     frequency of the core we run on (cpu, or core 0 if cpu < 0), the
+ *     load average and the stabilization settings in effect
+ */
+void runenv_print(int cpu, int heap_locked)
+{
+    char buf[RUNENV_MAXLINE];
+    char path[RUNENV_MAXLINE];
+    double load[3];
+    int core = (cpu < 0) ? 0 : cpu;
+
+    printf("Run environment:\n");
+
+    cpu_model(buf, sizeof(buf));
+    printf("  CPU model   : %s\n", buf);
+
+    if (cpu < 0)
+	printf("  Pinned to   : no\n");
+    else
+	printf("  Pinned to   : cpu %d\n", cpu);
+
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor",
+	    core);
+    if (read_line(path, buf, sizeof(buf)) < 0)
+	strcpy(buf, "unknown");
+    printf("  Governor    : %s (cpu %d)\n", buf, core);
+
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq",
+	    core);
+    if (read_line(path, buf, sizeof(buf)) < 0)
+	printf("  Frequency   : unknown\n");
+    else
+	printf("  Frequency   : %.0f MHz\n", atof(buf) / 1e3);
+
+    if (getloadavg(load, 3) == 3)
+	printf("  Load avg    : %.2f %.2f %.2f\n", load[0], load[1], load[2]);
+    else
+	printf("  Load avg    : unknown\n");
+
+    printf("  Nice value  : %d\n", getpriority(PRIO_PROCESS, 0));
+    printf("  Heap locked : %s\n", heap_locked ? "yes" : "no");
+}
+
+/*
+ * read_line - read the first line of a (sysfs or procfs) file into buf,
+ *     without its newline. Returns -1 if the file cannot be read.
+ */
+static int read_line(char *path, char *buf, int len)
+{
+    FILE *fp;
+    char *nl;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	return -1;
+    if (fgets(buf, len, fp) == NULL) {
+	fclose(fp);
+	return -1;
+    }
+    fclose(fp);
+    if ((nl = strchr(buf, '\n')) != NULL)
+	*nl = '\0';
+    return 0;
+}
+
+/*
+ * cpu_model - copy the "model name" field of /proc/cpuinfo into buf
+ */
+static void cpu_model(char *buf, int len)
+{
+    FILE *fp;
+    char line[RUNENV_MAXLINE];
+    char *colon, *nl;
+
+    strcpy(buf, "unknown");
+    if ((fp = fopen("/proc/cpuinfo", "r")) == NULL)
+	return;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if (strncmp(line, "model name", 10) != 0)
+	    continue;
+	if ((colon = strchr(line, ':')) == NULL)
+	    break;
+	for (colon++; *colon == ' ' || *colon == '\t'; colon++)
+	    ;
+	if ((nl = strchr(colon, '\n')) != NULL)
+	    *nl = '\0';
+	strncpy(buf, colon, len - 1);
+	buf[len - 1] = '\0';
+	break;
+    }
+    fclose(fp);
+}
@@ -0,0 +1,7 @@
+/*
+ * runenv.h - routines that stabilize and describe the environment
+ *     the driver's timing runs execute in
+ */
+int runenv_pin_cpu(int cpu);
+int runenv_raise_priority(void);
+void runenv_print(int cpu, int heap_locked);
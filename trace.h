@@ -0,0 +1,32 @@
+/*
+ * trace.h - reading malloc lab trace (.rep) files, shared by mdriver
+ *     and the tracestat analyzer
+ */
+#include <stddef.h>
+
+#define TRACE_HDRLINES       4 /* number of header lines in a trace file */
+#define TRACE_LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum {ALLOC, FREE, REALLOC, CALLOC, MEMALIGN,
+	  BATCH_ALLOC, BATCH_FREE} type; /* type of request */
+    int index;                        /* index for free() to use later */
+    int size;                         /* byte size of any request but free */
+    int align;                        /* alignment of a memalign request */
+    int count;                        /* number of ids of a batch request */
+} traceop_t;
+
+/* Holds the information for one trace file*/
+typedef struct {
+    int sugg_heapsize;   /* suggested heap size (unused) */
+    int num_ids;         /* number of alloc/realloc ids */
+    int num_ops;         /* number of distinct requests */
+    int weight;          /* weight for this trace (unused) */
+    traceop_t *ops;      /* array of requests */
+    char **blocks;       /* array of ptrs returned by malloc/realloc... */
+    size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+} trace_t;
+
+trace_t *read_trace(char *tracedir, char *filename);
+void free_trace(trace_t *trace);
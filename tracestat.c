@@ -0,0 +1,426 @@
+/*
+ * tracestat.c - Describes the workload in malloc lab trace files.
+ *
+ * For each trace it reports the op mix, a histogram of request sizes,
+ * the distribution of block lifetimes (in ops, from the alloc to the
+ * free of a block id, reallocs included), the peak live bytes and
+ * blocks, the realloc chains of each block id and how fast they grow,
+ * and the fraction of frees that release the most recently allocated
+ * live block (LIFO order). The output is a text report, or JSON with -j.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "trace.h"
+
+/* Size bucket b holds requests of at most 8 * 2^b bytes */
+#define SIZE_BUCKETS 28
+
+/* Lifetime bucket b holds lifetimes of at most 2^b ops */
+#define LIFE_BUCKETS 32
+
+/* The realloc history of one block id */
+typedef struct {
+    int id;              /* block id */
+    int reallocs;        /* number of reallocs of the id */
+    int first_size;      /* size it was allocated with */
+    int last_size;       /* size of its last realloc */
+} chain_t;
+
+/* Everything tracestat reports about one trace */
+typedef struct {
+    char *name;                       /* trace file name */
+    int ops[7];                       /* number of ops, by traceop_t type */
+    int batch_allocs;                 /* ids allocated by batch requests */
+    int batch_frees;                  /* ids freed by batch requests */
+    double size_hist[SIZE_BUCKETS];   /* request sizes, frees excepted */
+    int min_size, max_size;           /* smallest and largest request */
+    double total_size;                /* sum of request sizes */
+    double life_hist[LIFE_BUCKETS];   /* lifetimes of freed blocks */
+    double total_life;                /* sum of those lifetimes */
+    int never_freed;                  /* blocks still live at the end */
+    double peak_bytes;                /* most payload bytes live at once */
+    int peak_bytes_op;                /* op at which that happens */
+    int peak_blocks;                  /* most blocks live at once */
+    int peak_blocks_op;               /* op at which that happens */
+    int lifo_frees;                   /* frees of the youngest live block */
+    chain_t *chains;                  /* ids that were realloced */
+    int num_chains;
+    double log_growth;                /* sum of log(new/old) over reallocs */
+    int growth_steps;                 /* number of terms in that sum */
+} tstat_t;
+
+static void analyze(trace_t *trace, tstat_t *ts);
+static int size_bucket(int size);
+static int life_bucket(int ops);
+static void print_text(tstat_t *ts, int verbose);
+static void print_json(tstat_t *ts, int n);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+    int c, i, n;
+    int json = 0, verbose = 0;
+    tstat_t *stats;
+    trace_t *trace;
+
+    while ((c = getopt(argc, argv, "jvh")) != EOF) {
+	switch (c) {
+	case 'j': /* JSON output */
+	    json = 1;
+	    break;
+	case 'v': /* List every realloc chain in the text report */
+	    verbose = 1;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    n = argc - optind;
+    if (n == 0) {
+	usage();
+	exit(1);
+    }
+
+    if ((stats = (tstat_t *)calloc(n, sizeof(tstat_t))) == NULL) {
+	perror("calloc in main failed");
+	exit(1);
+    }
+    for (i = 0; i < n; i++) {
+	trace = read_trace("", argv[optind + i]);
+	stats[i].name = argv[optind + i];
+	analyze(trace, &stats[i]);
+	free_trace(trace);
+    }
+
+    if (json)
+	print_json(stats, n);
+    else
+	for (i = 0; i < n; i++)
+	    print_text(&stats[i], verbose);
+
+    for (i = 0; i < n; i++)
+	free(stats[i].chains);
+    free(stats);
+    exit(0);
+}
+
+/*
+ * analyze - replay a trace without allocating anything, tracking the
+ *     size, birth and allocation order of every live block id
+ */
+static void analyze(trace_t *trace, tstat_t *ts)
+{
+    int *size, *birth, *reallocs, *first_size, *last_size;
+    int *older, *younger;  /* live ids, in order of (re)allocation */
+    int youngest = -1;
+    double live_bytes = 0;
+    int live_blocks = 0;
+    int i, k, n, id, sz, type;
+
+    size = (int *)calloc(trace->num_ids, sizeof(int));
+    birth = (int *)malloc(trace->num_ids * sizeof(int));
+    reallocs = (int *)calloc(trace->num_ids, sizeof(int));
+    first_size = (int *)calloc(trace->num_ids, sizeof(int));
+    last_size = (int *)calloc(trace->num_ids, sizeof(int));
+    older = (int *)malloc(trace->num_ids * sizeof(int));
+    younger = (int *)malloc(trace->num_ids * sizeof(int));
+    if (!size || !birth || !reallocs || !first_size || !last_size || !older || !younger) {
+	perror("malloc in analyze failed");
+	exit(1);
+    }
+    for (i = 0; i < trace->num_ids; i++)
+	birth[i] = -1;
+    ts->min_size = -1;
+
+    for (i = 0; i < trace->num_ops; i++) {
+	ts->ops[trace->ops[i].type]++;
+
+	/* A batch request counts as one request per id of the batch */
+	type = trace->ops[i].type;
+	n = 1;
+	if (type == BATCH_ALLOC || type == BATCH_FREE) {
+	    n = trace->ops[i].count;
+	    if (type == BATCH_ALLOC) {
+		type = ALLOC;
+		ts->batch_allocs += n;
+	    }
+	    else {
+		type = FREE;
+		ts->batch_frees += n;
+	    }
+	}
+
+	for (k = 0; k < n; k++) {
+	    id = trace->ops[i].index + k;
+	    sz = trace->ops[i].size;
+
+	    /* Unlink a freed or realloced id from the allocation order */
+	    if ((type == FREE || type == REALLOC) && birth[id] >= 0) {
+		if (type == FREE && id == youngest)
+		    ts->lifo_frees++;
+		if (id == youngest)
+		    youngest = older[id];
+		else
+		    older[younger[id]] = older[id];
+		if (older[id] >= 0)
+		    younger[older[id]] = younger[id];
+	    }
+
+	    switch (type) {
+	    case ALLOC:
+	    case CALLOC:
+	    case MEMALIGN:
+		birth[id] = i;
+		first_size[id] = sz;
+		live_blocks++;
+		break;
+	    case REALLOC:
+		if (birth[id] < 0) {   /* realloc(NULL, size) */
+		    birth[id] = i;
+		    first_size[id] = sz;
+		    live_blocks++;
+		    break;
+		}
+		reallocs[id]++;
+		if (size[id] > 0 && sz > 0) {
+		    ts->log_growth += log((double)sz / size[id]);
+		    ts->growth_steps++;
+		}
+		live_bytes -= size[id];
+		break;
+	    case FREE:
+		if (birth[id] < 0)
+		    continue;
+		ts->life_hist[life_bucket(i - birth[id])]++;
+		ts->total_life += i - birth[id];
+		live_bytes -= size[id];
+		live_blocks--;
+		birth[id] = -1;
+		size[id] = 0;
+		continue;
+	    }
+
+	    /* An alloc or realloc: the id is now the youngest live block */
+	    size[id] = sz;
+	    last_size[id] = sz;
+	    live_bytes += sz;
+	    older[id] = youngest;
+	    younger[id] = -1;
+	    if (youngest >= 0)
+		younger[youngest] = id;
+	    youngest = id;
+
+	    ts->size_hist[size_bucket(sz)]++;
+	    ts->total_size += sz;
+	    if (ts->min_size < 0 || sz < ts->min_size)
+		ts->min_size = sz;
+	    if (sz > ts->max_size)
+		ts->max_size = sz;
+	    if (live_bytes > ts->peak_bytes) {
+		ts->peak_bytes = live_bytes;
+		ts->peak_bytes_op = i;
+	    }
+	    if (live_blocks > ts->peak_blocks) {
+		ts->peak_blocks = live_blocks;
+		ts->peak_blocks_op = i;
+	    }
+	}
+    }
+
+    /* Blocks never freed, and the realloc chain of every id */
+    for (id = 0; id < trace->num_ids; id++) {
+	if (birth[id] >= 0)
+	    ts->never_freed++;
+	if (reallocs[id] > 0)
+	    ts->num_chains++;
+    }
+    if ((ts->chains = (chain_t *)malloc((ts->num_chains + 1) * sizeof(chain_t))) == NULL) {
+	perror("malloc in analyze failed");
+	exit(1);
+    }
+    ts->num_chains = 0;
+    for (id = 0; id < trace->num_ids; id++) {
+	if (reallocs[id] == 0)
+	    continue;
+	ts->chains[ts->num_chains].id = id;
+	ts->chains[ts->num_chains].reallocs = reallocs[id];
+	ts->chains[ts->num_chains].first_size = first_size[id];
+	ts->chains[ts->num_chains].last_size = last_size[id];
+	ts->num_chains++;
+    }
+
+    free(size);
+    free(birth);
+    free(reallocs);
+    free(first_size);
+    free(last_size);
+    free(older);
+    free(younger);
+}
+
+/*
+ * size_bucket - histogram bucket of a request of size bytes
+ */
+static int size_bucket(int size)
+{
+    int b = 0;
+
+    while (b < SIZE_BUCKETS - 1 && (8 << b) < size)
+	b++;
+    return b;
+}
+
+/*
+ * life_bucket - histogram bucket of a lifetime of ops ops
+ */
+static int life_bucket(int ops)
+{
+    int b = 0;
+
+    while (b < LIFE_BUCKETS - 1 && (1 << b) < ops)
+	b++;
+    return b;
+}
+
+/*
+ * chain_growth - overall growth factor of a realloc chain
+ */
+static double chain_growth(chain_t *c)
+{
+    return c->first_size > 0 ? (double)c->last_size / c->first_size : 0.0;
+}
+
+/*
+ * print_text - print the report for one trace
+ */
+static void print_text(tstat_t *ts, int verbose)
+{
+    int requests = ts->ops[ALLOC] + ts->ops[CALLOC] + ts->ops[MEMALIGN] +
+	ts->ops[REALLOC] + ts->batch_allocs;
+    int b, i, total = ts->ops[ALLOC] + ts->ops[CALLOC] + ts->ops[MEMALIGN] +
+	ts->ops[REALLOC] + ts->ops[FREE] + ts->ops[BATCH_ALLOC] +
+	ts->ops[BATCH_FREE];
+    int freed = ts->ops[FREE] + ts->batch_frees;
+    double freed_blocks = 0;
+    int max_chain = 0;
+
+    printf("%s\n", ts->name);
+    printf("  ops        %8d (alloc %.1f%%, calloc %.1f%%, memalign %.1f%%, "
+	   "free %.1f%%, realloc %.1f%%)\n", total,
+	   100.0 * ts->ops[ALLOC] / total, 100.0 * ts->ops[CALLOC] / total,
+	   100.0 * ts->ops[MEMALIGN] / total, 100.0 * ts->ops[FREE] / total,
+	   100.0 * ts->ops[REALLOC] / total);
+    if (ts->ops[BATCH_ALLOC] + ts->ops[BATCH_FREE] > 0)
+	printf("  batches    %8d allocs of %d ids, %d frees of %d ids\n",
+	       ts->ops[BATCH_ALLOC], ts->batch_allocs, ts->ops[BATCH_FREE],
+	       ts->batch_frees);
+    printf("  sizes      %8d..%d bytes, mean %.1f\n", ts->min_size,
+	   ts->max_size, requests ? ts->total_size / requests : 0.0);
+    printf("  peak live  %8.0f bytes at op %d, %d blocks at op %d\n",
+	   ts->peak_bytes, ts->peak_bytes_op, ts->peak_blocks,
+	   ts->peak_blocks_op);
+    printf("  LIFO frees %7.1f%%\n", freed ? 100.0 * ts->lifo_frees / freed : 0.0);
+
+    printf("  request sizes:\n");
+    for (b = 0; b < SIZE_BUCKETS; b++)
+	if (ts->size_hist[b] > 0)
+	    printf("    <= %10d %8.0f %5.1f%%\n", 8 << b, ts->size_hist[b],
+		   100.0 * ts->size_hist[b] / requests);
+
+    for (b = 0; b < LIFE_BUCKETS; b++)
+	freed_blocks += ts->life_hist[b];
+    printf("  lifetimes (ops), mean %.1f, %d blocks never freed:\n",
+	   freed_blocks ? ts->total_life / freed_blocks : 0.0, ts->never_freed);
+    for (b = 0; b < LIFE_BUCKETS; b++)
+	if (ts->life_hist[b] > 0)
+	    printf("    <= %10u %8.0f %5.1f%%\n", 1u << b, ts->life_hist[b],
+		   100.0 * ts->life_hist[b] / freed_blocks);
+
+    for (i = 0; i < ts->num_chains; i++)
+	if (ts->chains[i].reallocs > max_chain)
+	    max_chain = ts->chains[i].reallocs;
+    printf("  realloc chains %d, longest %d, growth per realloc %.3f\n",
+	   ts->num_chains, max_chain,
+	   ts->growth_steps ? exp(ts->log_growth / ts->growth_steps) : 0.0);
+    if (verbose)
+	for (i = 0; i < ts->num_chains; i++)
+	    printf("    id %6d: %4d reallocs, %d -> %d bytes, x%.2f\n",
+		   ts->chains[i].id, ts->chains[i].reallocs,
+		   ts->chains[i].first_size, ts->chains[i].last_size,
+		   chain_growth(&ts->chains[i]));
+    printf("\n");
+}
+
+/*
+ * print_json - print the reports for all n traces as a JSON array
+ */
+static void print_json(tstat_t *stats, int n)
+{
+    int b, i, t;
+    tstat_t *ts;
+
+    printf("[\n");
+    for (t = 0; t < n; t++) {
+	ts = &stats[t];
+	printf("  {\n");
+	printf("    \"trace\": \"%s\",\n", ts->name);
+	printf("    \"ops\": {\"alloc\": %d, \"calloc\": %d, \"memalign\": %d, "
+	       "\"free\": %d, \"realloc\": %d, \"batch_alloc\": %d, "
+	       "\"batch_free\": %d},\n", ts->ops[ALLOC],
+	       ts->ops[CALLOC], ts->ops[MEMALIGN], ts->ops[FREE],
+	       ts->ops[REALLOC], ts->ops[BATCH_ALLOC], ts->ops[BATCH_FREE]);
+	printf("    \"batch_ids\": {\"alloc\": %d, \"free\": %d},\n",
+	       ts->batch_allocs, ts->batch_frees);
+	printf("    \"min_size\": %d, \"max_size\": %d, \"total_size\": %.0f,\n",
+	       ts->min_size, ts->max_size, ts->total_size);
+	printf("    \"size_hist\": [");
+	for (b = 0; b < SIZE_BUCKETS; b++)
+	    printf("%s{\"max\": %d, \"count\": %.0f}", b ? ", " : "",
+		   8 << b, ts->size_hist[b]);
+	printf("],\n");
+	printf("    \"life_hist\": [");
+	for (b = 0; b < LIFE_BUCKETS; b++)
+	    printf("%s{\"max\": %u, \"count\": %.0f}", b ? ", " : "",
+		   1u << b, ts->life_hist[b]);
+	printf("],\n");
+	printf("    \"total_life\": %.0f, \"never_freed\": %d,\n",
+	       ts->total_life, ts->never_freed);
+	printf("    \"peak_bytes\": %.0f, \"peak_bytes_op\": %d,\n",
+	       ts->peak_bytes, ts->peak_bytes_op);
+	printf("    \"peak_blocks\": %d, \"peak_blocks_op\": %d,\n",
+	       ts->peak_blocks, ts->peak_blocks_op);
+	printf("    \"lifo_frees\": %d,\n", ts->lifo_frees);
+	printf("    \"growth_per_realloc\": %.4f,\n",
+	       ts->growth_steps ? exp(ts->log_growth / ts->growth_steps) : 0.0);
+	printf("    \"realloc_chains\": [");
+	for (i = 0; i < ts->num_chains; i++)
+	    printf("%s\n      {\"id\": %d, \"reallocs\": %d, \"first_size\": %d, "
+		   "\"last_size\": %d, \"growth\": %.4f}", i ? "," : "",
+		   ts->chains[i].id, ts->chains[i].reallocs,
+		   ts->chains[i].first_size, ts->chains[i].last_size,
+		   chain_growth(&ts->chains[i]));
+	printf("%s]\n", ts->num_chains ? "\n    " : "");
+	printf("  }%s\n", t < n - 1 ? "," : "");
+    }
+    printf("]\n");
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tracestat [-hjv] <file> ...\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j         Print the reports as JSON.\n");
+    fprintf(stderr, "\t-v         List every realloc chain.\n");
+}